@@ -0,0 +1,214 @@
+#define _GNU_SOURCE
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sshell.h"
+
+#define SAMPLES_DEFAULT 200
+#define WARMUP_DEFAULT 20
+
+/*
+ * Microbenchmarks for the shell core, linked against libsshell.a.
+ *
+ * Usage: micro [-n SAMPLES] [-w WARMUP] [CORPUS]
+ *
+ * Each sample is one pass over every line of the corpus (bench/corpus.txt by
+ * default, one command line per line), timed with CLOCK_MONOTONIC. WARMUP
+ * passes run first and are not timed. Results are nanoseconds per line:
+ *
+ *   lex+check     lex_line() and parse_errors()
+ *   processes     initialize_processes() on the checked tokens
+ *   command list  parse_command_list() and free_command_list()
+ *   pipe setup    create_pipes() and close_pipes() on every pipeline
+ *
+ * Lines with parse errors are kept for the lex+check pass only.
+ */
+
+typedef struct corpus {
+    char **lines;
+    size_t count;
+
+    /* Lines that parse, for the later stages. */
+    char **valid;
+    size_t num_valid;
+} Corpus;
+
+typedef void (*PassFn)(const Corpus *c);
+
+double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Sink for results, so passes aren't optimized away. */
+volatile int sink;
+
+void pass_lex(const Corpus *c) {
+    char line[CMDLINE_MAX];
+    unsigned char mask[CMDLINE_MAX];
+    Token tokens[CMDLINE_MAX + 1];
+
+    for (size_t i = 0; i < c->count; i++) {
+        strcpy(line, c->lines[i]);
+        ErrorType e = lex_line(line, mask, tokens);
+        if (e == NO_ERROR) e = parse_errors(tokens);
+        sink += e;
+    }
+}
+
+/* Checked tokens of every valid line, lexed once. initialize_processes()
+ * only reads them, so every pass can reuse them. */
+Token **valid_tokens;
+
+void pass_processes(const Corpus *c) {
+    for (size_t i = 0; i < c->num_valid; i++) {
+        Token *t = valid_tokens[i];
+        while (t->type != TOK_END) {
+            Process *p = initialize_processes(&t);
+            sink += p->num_args;
+            free_processes(p);
+            if (t->type != TOK_END) t++;
+        }
+    }
+}
+
+void pass_command_list(const Corpus *c) {
+    char line[CMDLINE_MAX];
+
+    for (size_t i = 0; i < c->num_valid; i++) {
+        Pipeline *list;
+        strcpy(line, c->valid[i]);
+        sink += parse_command_list(line, &list);
+        free_command_list(list);
+        arena_reset(&cmd_arena);
+    }
+}
+
+/* Command lists for the pipe setup pass, built once. */
+Pipeline **pipe_lists;
+
+void pass_pipes(const Corpus *c) {
+    for (size_t i = 0; i < c->num_valid; i++) {
+        for (Pipeline *pl = pipe_lists[i]; pl; pl = pl->next) {
+            create_pipes(pl->head);
+            close_pipes(pl->head);
+        }
+    }
+}
+
+bool load_corpus(const char *path, Corpus *c) {
+    FILE *f = fopen(path, "r");
+    if (!f) return false;
+
+    size_t cap = 64;
+    char buf[CMDLINE_MAX];
+    c->lines = malloc(cap * sizeof(char *));
+    c->valid = malloc(cap * sizeof(char *));
+    c->count = c->num_valid = 0;
+    while (fgets(buf, sizeof(buf), f)) {
+        buf[strcspn(buf, "\n")] = '\0';
+        if (!buf[0]) continue;
+        if (c->count == cap) {
+            cap *= 2;
+            c->lines = realloc(c->lines, cap * sizeof(char *));
+            c->valid = realloc(c->valid, cap * sizeof(char *));
+        }
+        c->lines[c->count++] = strdup(buf);
+
+        char copy[CMDLINE_MAX];
+        unsigned char mask[CMDLINE_MAX];
+        Token tokens[CMDLINE_MAX + 1];
+        strcpy(copy, buf);
+        ErrorType e = lex_line(copy, mask, tokens);
+        if (e == NO_ERROR) e = parse_errors(tokens);
+        if (e == NO_ERROR) c->valid[c->num_valid++] = c->lines[c->count - 1];
+    }
+    fclose(f);
+    return c->count > 0;
+}
+
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* Runs warmup untimed passes and then samples timed ones. Fills samples with
+ * nanoseconds per line. */
+void measure(PassFn pass, const Corpus *c, size_t lines, int warmup,
+             int samples, double *out) {
+    for (int i = 0; i < warmup; i++) pass(c);
+    for (int i = 0; i < samples; i++) {
+        double start = now_ns();
+        pass(c);
+        out[i] = (now_ns() - start) / lines;
+    }
+}
+
+void report(const char *name, double *s, int n) {
+    qsort(s, n, sizeof(double), compare_doubles);
+    double sum = 0, sq = 0;
+    for (int i = 0; i < n; i++) sum += s[i];
+    double mean = sum / n;
+    for (int i = 0; i < n; i++) sq += (s[i] - mean) * (s[i] - mean);
+    double stddev = n > 1 ? sqrt(sq / (n - 1)) : 0;
+
+    printf("%-13s %9.1f %9.1f %9.1f %9.1f %9.1f\n", name, s[0], s[n / 2], mean,
+           stddev, s[(n * 99) / 100]);
+}
+
+int main(int argc, char *argv[]) {
+    const char *path = "bench/corpus.txt";
+    int samples = SAMPLES_DEFAULT, warmup = WARMUP_DEFAULT;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-n") && i + 1 < argc)
+            samples = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-w") && i + 1 < argc)
+            warmup = atoi(argv[++i]);
+        else
+            path = argv[i];
+    }
+    if (samples < 1) samples = 1;
+
+    Corpus c;
+    if (!load_corpus(path, &c)) {
+        fprintf(stderr, "micro: cannot read corpus %s\n", path);
+        return EXIT_FAILURE;
+    }
+
+    pipe_lists = malloc(c.num_valid * sizeof(Pipeline *));
+    valid_tokens = malloc(c.num_valid * sizeof(Token *));
+    for (size_t i = 0; i < c.num_valid; i++) {
+        char *line = strdup(c.valid[i]);
+        parse_command_list(line, &pipe_lists[i]);
+
+        line = strdup(c.valid[i]);
+        valid_tokens[i] = malloc((CMDLINE_MAX + 1) * sizeof(Token));
+        lex_line(line, malloc(CMDLINE_MAX), valid_tokens[i]);
+        parse_errors(valid_tokens[i]);
+    }
+
+    double *lex = malloc(samples * sizeof(double));
+    double *procs = malloc(samples * sizeof(double));
+    double *lists = malloc(samples * sizeof(double));
+    double *pipes = malloc(samples * sizeof(double));
+
+    measure(pass_lex, &c, c.count, warmup, samples, lex);
+    measure(pass_processes, &c, c.num_valid, warmup, samples, procs);
+    measure(pass_command_list, &c, c.num_valid, warmup, samples, lists);
+    measure(pass_pipes, &c, c.num_valid, warmup, samples, pipes);
+
+    printf("%s: %zu lines (%zu valid), %d samples after %d warmup\n", path,
+           c.count, c.num_valid, samples, warmup);
+    printf("%-13s %9s %9s %9s %9s %9s   (ns/line)\n", "", "min", "median",
+           "mean", "stddev", "p99");
+    report("lex+check", lex, samples);
+    report("processes", procs, samples);
+    report("command list", lists, samples);
+    report("pipe setup", pipes, samples);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,136 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RUNS_DEFAULT 500
+#define PROMPT "sshell@ucd$ "
+
+/*
+ * Startup benchmark for sshell.
+ *
+ * Usage: startup [-n RUNS] [SSHELL]
+ *
+ * Measures, over RUNS launches each:
+ *   exec-to-prompt  fork+exec until the first prompt can be read from stdout
+ *   exec-to-exit    the same shell until it exits on EOF after that prompt
+ *   -c true         `sshell -c true` until it exits
+ *   /bin/true       the same fork+exec+wait without the shell, as a floor
+ */
+
+double now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/* Starts argv with stdin and stdout connected to the given fds (or
+ * /dev/null for -1) and stderr discarded. */
+pid_t launch(char *const argv[], int in, int out) {
+    pid_t pid = fork();
+    if (pid) return pid;
+
+    int null = open("/dev/null", O_RDWR);
+    dup2(in == -1 ? null : in, STDIN_FILENO);
+    dup2(out == -1 ? null : out, STDOUT_FILENO);
+    dup2(null, STDERR_FILENO);
+    execv(argv[0], argv);
+    _exit(127);
+}
+
+/* Runs argv to completion. Returns the time it took. */
+double time_run(char *const argv[]) {
+    double start = now_us();
+    pid_t pid = launch(argv, -1, -1);
+    waitpid(pid, NULL, 0);
+    return now_us() - start;
+}
+
+/* Starts an interactive shell on pipes and records when its first prompt
+ * arrives and when it exits after stdin is closed. Returns false if the
+ * prompt never showed up. */
+bool time_prompt(const char *shell, double *to_prompt, double *to_exit) {
+    int in[2], out[2];
+    if (pipe2(in, O_CLOEXEC) == -1 || pipe2(out, O_CLOEXEC) == -1)
+        return false;
+    char *argv[] = {(char *)shell, NULL};
+
+    double start = now_us();
+    pid_t pid = launch(argv, in[0], out[1]);
+    close(in[0]);
+    close(out[1]);
+
+    char buf[256];
+    size_t len = 0;
+    ssize_t n;
+    bool seen = false;
+    while (!seen && (n = read(out[0], buf + len, sizeof(buf) - 1 - len)) > 0) {
+        len += n;
+        buf[len] = '\0';
+        seen = strstr(buf, PROMPT) != NULL;
+        if (len == sizeof(buf) - 1) len = 0;
+    }
+    *to_prompt = now_us() - start;
+
+    close(in[1]);
+    while (read(out[0], buf, sizeof(buf)) > 0)
+        ;
+    waitpid(pid, NULL, 0);
+    *to_exit = now_us() - start;
+    close(out[0]);
+    return seen;
+}
+
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+void report(const char *name, double *samples, int n) {
+    qsort(samples, n, sizeof(double), compare_doubles);
+    double sum = 0;
+    for (int i = 0; i < n; i++) sum += samples[i];
+    printf("%-16s min %8.1f  median %8.1f  mean %8.1f  p99 %8.1f  (us)\n", name,
+           samples[0], samples[n / 2], sum / n, samples[(n * 99) / 100]);
+}
+
+int main(int argc, char *argv[]) {
+    int runs = RUNS_DEFAULT;
+    const char *shell = "./sshell";
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-n") && i + 1 < argc)
+            runs = atoi(argv[++i]);
+        else
+            shell = argv[i];
+    }
+    if (runs < 1) runs = 1;
+
+    double *prompt = malloc(runs * sizeof(double));
+    double *exit_eof = malloc(runs * sizeof(double));
+    double *one_shot = malloc(runs * sizeof(double));
+    double *floor = malloc(runs * sizeof(double));
+    char *c_argv[] = {(char *)shell, "-c", "true", NULL};
+    char *true_argv[] = {"/bin/true", NULL};
+
+    for (int i = 0; i < runs; i++) {
+        if (!time_prompt(shell, &prompt[i], &exit_eof[i])) {
+            fprintf(stderr, "startup: no prompt from %s\n", shell);
+            return EXIT_FAILURE;
+        }
+        one_shot[i] = time_run(c_argv);
+        floor[i] = time_run(true_argv);
+    }
+
+    printf("%s, %d runs\n", shell, runs);
+    report("exec-to-prompt", prompt, runs);
+    report("exec-to-exit", exit_eof, runs);
+    report("-c true", one_shot, runs);
+    report("/bin/true", floor, runs);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,357 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LINE_MAX_LEN 511
+#define READ_BUF_SIZE 65536
+
+/*
+ * End-to-end benchmark suite for sshell.
+ *
+ * Usage: suite [-q] [-o RESULTS.json] [SSHELL]
+ *
+ * Drives one shell per workload over pipes, writing command lines to its
+ * stdin and timing each line until its completion messages arrive on
+ * stderr. Everything the commands print on stdout is read and counted.
+ *
+ *   true           trivial commands, fork/exec cost
+ *   cat-N          `echo x | cat | ... | cat` pipelines N processes wide
+ *   yes-head       `yes | head -c BYTES` streamed through the shell's stdout
+ *   sls-N          sls in a directory of N empty files
+ *   head-N         the builtin head copying an N-line listing file
+ *   parse-heavy    full-length `cd . && ...` lines that never fork
+ *
+ * The sls and head workloads on the largest inputs run again with
+ * `set -o splice` as sls-N-splice and head-N-splice, comparing vmsplice()
+ * with write() for builtin output.
+ *
+ * -q runs smaller workloads. Results are printed as a table and, with -o,
+ * written as JSON so runs on different commits can be compared.
+ */
+
+/* Summary of one workload. */
+typedef struct result {
+    char name[32];
+    int ops;
+    double seconds;
+    double p50_us, p99_us;
+    unsigned long long bytes;
+} Result;
+
+/* A shell being driven over pipes. */
+typedef struct driver {
+    pid_t pid;
+    int in, out, err;
+    unsigned long long out_bytes;
+} Driver;
+
+double now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/* Starts the shell in dir with all three standard streams on pipes. */
+bool driver_start(Driver *d, const char *shell, const char *dir) {
+    int in[2], out[2], err[2];
+    if (pipe2(in, O_CLOEXEC) == -1 || pipe2(out, O_CLOEXEC) == -1 ||
+        pipe2(err, O_CLOEXEC) == -1)
+        return false;
+
+    d->pid = fork();
+    if (!d->pid) {
+        dup2(in[0], STDIN_FILENO);
+        dup2(out[1], STDOUT_FILENO);
+        dup2(err[1], STDERR_FILENO);
+        if (dir && chdir(dir) == -1) _exit(127);
+        execl(shell, shell, (char *)NULL);
+        _exit(127);
+    }
+    close(in[0]);
+    close(out[1]);
+    close(err[1]);
+    d->in = in[1];
+    d->out = out[0];
+    d->err = err[0];
+    d->out_bytes = 0;
+    return d->pid > 0;
+}
+
+/* Reads the shell's output until `lines` newlines have arrived on stderr.
+ * stdout is drained and counted meanwhile so the shell never blocks on it.
+ * Returns false if the shell went away first. */
+bool driver_wait(Driver *d, int lines) {
+    static char buf[READ_BUF_SIZE];
+    struct pollfd fds[2] = {{d->out, POLLIN, 0}, {d->err, POLLIN, 0}};
+
+    while (lines > 0) {
+        if (poll(fds, 2, -1) == -1) return false;
+        if (fds[0].revents) {
+            ssize_t n = read(d->out, buf, sizeof(buf));
+            if (n > 0) d->out_bytes += n;
+            if (n <= 0) fds[0].fd = -1;
+        }
+        if (fds[1].revents) {
+            ssize_t n = read(d->err, buf, sizeof(buf));
+            if (n <= 0) return false;
+            for (char *c = buf; (c = memchr(c, '\n', buf + n - c)); c++)
+                lines--;
+        }
+    }
+    return true;
+}
+
+/* Runs one line and waits for its `lines` completion messages. Returns the
+ * time it took in microseconds, or -1 on failure. */
+double driver_run(Driver *d, const char *line, int lines) {
+    char buf[LINE_MAX_LEN + 2];
+    int n = snprintf(buf, sizeof(buf), "%s\n", line);
+    double start = now_us();
+    if (write(d->in, buf, n) != n || !driver_wait(d, lines)) return -1;
+    return now_us() - start;
+}
+
+void driver_stop(Driver *d) {
+    close(d->in);
+    driver_wait(d, 1 << 30);
+    close(d->out);
+    close(d->err);
+    waitpid(d->pid, NULL, 0);
+}
+
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* Runs line reps times in a fresh shell started in dir, and fills in r.
+ * setup, if not NULL, is a single-pipeline line run first. */
+bool run_workload(Result *r, const char *name, const char *shell,
+                  const char *dir, const char *setup, const char *line,
+                  int lines, int reps) {
+    Driver d;
+    double *samples = malloc(reps * sizeof(double));
+    if (!driver_start(&d, shell, dir)) return false;
+
+    /* One untimed run warms up caches in the shell and the kernel. */
+    bool ok = !setup || driver_run(&d, setup, 1) >= 0;
+    ok = ok && driver_run(&d, line, lines) >= 0;
+    unsigned long long before = d.out_bytes;
+    double start = now_us();
+    for (int i = 0; ok && i < reps; i++) {
+        samples[i] = driver_run(&d, line, lines);
+        ok = samples[i] >= 0;
+    }
+    double total = now_us() - start;
+    unsigned long long bytes = d.out_bytes - before;
+    driver_stop(&d);
+    if (!ok) {
+        fprintf(stderr, "suite: %s: shell exited early\n", name);
+        free(samples);
+        return false;
+    }
+
+    qsort(samples, reps, sizeof(double), compare_doubles);
+    snprintf(r->name, sizeof(r->name), "%s", name);
+    r->ops = reps;
+    r->seconds = total / 1e6;
+    r->p50_us = samples[reps / 2];
+    r->p99_us = samples[(reps * 99) / 100];
+    r->bytes = bytes;
+    free(samples);
+    return true;
+}
+
+/* Creates a directory of count empty files for sls. */
+bool make_listing_dir(const char *dir, int count) {
+    if (mkdir(dir, 0700) == -1) return false;
+    int dfd = open(dir, O_RDONLY | O_DIRECTORY);
+    char name[32];
+    for (int i = 0; i < count; i++) {
+        snprintf(name, sizeof(name), "f%07d", i);
+        int fd = openat(dfd, name, O_WRONLY | O_CREAT | O_EXCL, 0600);
+        if (fd == -1) {
+            close(dfd);
+            return false;
+        }
+        close(fd);
+    }
+    close(dfd);
+    return true;
+}
+
+void remove_listing_dir(const char *dir, int count) {
+    int dfd = open(dir, O_RDONLY | O_DIRECTORY);
+    char name[32];
+    for (int i = 0; dfd != -1 && i < count; i++) {
+        snprintf(name, sizeof(name), "f%07d", i);
+        unlinkat(dfd, name, 0);
+    }
+    if (dfd != -1) close(dfd);
+    rmdir(dir);
+}
+
+/* Writes a file of count numbered lines for head. */
+bool make_listing_file(const char *path, int count) {
+    FILE *f = fopen(path, "w");
+    if (!f) return false;
+    for (int i = 0; i < count; i++) fprintf(f, "f%07d (0 bytes)\n", i);
+    return fclose(f) == 0;
+}
+
+void print_result(const Result *r) {
+    double ops = r->ops / r->seconds;
+    double gbps = r->bytes / r->seconds / 1e9;
+    printf("%-18s %8d %10.3f %12.1f %10.3f %10.1f %10.1f\n", r->name, r->ops,
+           r->seconds, ops, gbps, r->p50_us, r->p99_us);
+}
+
+void write_json(const char *path, const Result *results, int n, bool quick) {
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        perror(path);
+        return;
+    }
+
+    char commit[64] = "unknown";
+    FILE *git = popen("git rev-parse --short HEAD 2>/dev/null", "r");
+    if (git) {
+        if (fgets(commit, sizeof(commit), git))
+            commit[strcspn(commit, "\n")] = '\0';
+        pclose(git);
+    }
+
+    fprintf(f, "{\n  \"commit\": \"%s\",\n  \"time\": %lld,\n  \"quick\": %s,\n",
+            commit, (long long)time(NULL), quick ? "true" : "false");
+    fprintf(f, "  \"results\": [\n");
+    for (int i = 0; i < n; i++) {
+        const Result *r = &results[i];
+        fprintf(f,
+                "    {\"name\": \"%s\", \"ops\": %d, \"seconds\": %.6f, "
+                "\"ops_per_sec\": %.1f, \"bytes\": %llu, \"gb_per_sec\": %.4f, "
+                "\"p50_us\": %.1f, \"p99_us\": %.1f}%s\n",
+                r->name, r->ops, r->seconds, r->ops / r->seconds, r->bytes,
+                r->bytes / r->seconds / 1e9, r->p50_us, r->p99_us,
+                i + 1 < n ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+    fclose(f);
+}
+
+int main(int argc, char *argv[]) {
+    const char *shell = "./sshell";
+    const char *json = NULL;
+    bool quick = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-q"))
+            quick = true;
+        else if (!strcmp(argv[i], "-o") && i + 1 < argc)
+            json = argv[++i];
+        else
+            shell = argv[i];
+    }
+
+    /* The shell runs in other directories, so it needs an absolute path. */
+    char shell_path[PATH_MAX];
+    if (!realpath(shell, shell_path)) {
+        perror(shell);
+        return EXIT_FAILURE;
+    }
+
+    int scale = quick ? 10 : 1;
+    Result results[16];
+    int n = 0;
+    char line[LINE_MAX_LEN + 1], name[32];
+
+    if (run_workload(&results[n], "true", shell_path, NULL, NULL, "true", 1,
+                     20000 / scale))
+        n++;
+
+    int widths[] = {8, 32, 64};
+    for (int w = 0; w < 3; w++) {
+        int len = snprintf(line, sizeof(line), "echo x");
+        for (int i = 0; i < widths[w] - 1; i++)
+            len += snprintf(line + len, sizeof(line) - len, " | cat");
+        snprintf(name, sizeof(name), "cat-%d", widths[w]);
+        if (run_workload(&results[n], name, shell_path, NULL, NULL, line, 1,
+                         4000 / widths[w] / scale))
+            n++;
+    }
+
+    snprintf(line, sizeof(line), "yes | head -c %lld",
+             quick ? 1LL << 30 : 10LL << 30);
+    if (run_workload(&results[n], "yes-head", shell_path, NULL, NULL, line, 1,
+                     3))
+        n++;
+
+    int sizes[] = {10000, 100000, 1000000};
+    for (int s = 0; s < 3; s++) {
+        char dir[PATH_MAX];
+        const char *tmp = getenv("TMPDIR");
+        int count = sizes[s] / scale;
+        snprintf(dir, sizeof(dir), "%s/sshell-bench-%d-%d", tmp ? tmp : "/tmp",
+                 (int)getpid(), count);
+        if (!make_listing_dir(dir, count)) {
+            fprintf(stderr, "suite: cannot create %s\n", dir);
+            remove_listing_dir(dir, count);
+            continue;
+        }
+        snprintf(name, sizeof(name), "sls-%d", count);
+        if (run_workload(&results[n], name, shell_path, dir, NULL, "sls", 1,
+                         s == 2 ? 5 : 20))
+            n++;
+        snprintf(name, sizeof(name), "sls-%d-splice", count);
+        if (s == 2 && run_workload(&results[n], name, shell_path, dir,
+                                   "set -o splice", "sls", 1, 5))
+            n++;
+        remove_listing_dir(dir, count);
+    }
+
+    char path[LINE_MAX_LEN / 2];
+    const char *tmp = getenv("TMPDIR");
+    int count = 4000000 / scale;
+    snprintf(path, sizeof(path), "%s/sshell-bench-%d.txt", tmp ? tmp : "/tmp",
+             (int)getpid());
+    if (make_listing_file(path, count)) {
+        snprintf(line, sizeof(line), "head -n %d %s", count, path);
+        snprintf(name, sizeof(name), "head-%d", count);
+        if (run_workload(&results[n], name, shell_path, NULL, NULL, line, 1,
+                         10))
+            n++;
+        snprintf(name, sizeof(name), "head-%d-splice", count);
+        if (run_workload(&results[n], name, shell_path, NULL, "set -o splice",
+                         line, 1, 10))
+            n++;
+    } else {
+        fprintf(stderr, "suite: cannot create %s\n", path);
+    }
+    unlink(path);
+
+    /* Each `cd .` is a pipeline of its own, reported with one message. */
+    const char *dots[] = {" && cd '.'", " && cd \".\"", " && cd \\."};
+    int pipelines = 1, len = snprintf(line, sizeof(line), "cd .");
+    while (len + strlen(dots[pipelines % 3]) <= LINE_MAX_LEN) {
+        len += snprintf(line + len, sizeof(line) - len, "%s",
+                        dots[pipelines % 3]);
+        pipelines++;
+    }
+    if (run_workload(&results[n], "parse-heavy", shell_path, NULL, NULL, line,
+                     pipelines, 5000 / scale))
+        n++;
+
+    printf("%-18s %8s %10s %12s %10s %10s %10s\n", "workload", "ops", "seconds",
+           "ops/sec", "GB/s", "p50 us", "p99 us");
+    for (int i = 0; i < n; i++) print_result(&results[i]);
+    if (json) write_json(json, results, n, quick);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,222 @@
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "reference.h"
+
+#define SLOWDOWN_DEFAULT 4.0
+#define TIMING_FLOOR_NS 20000
+#define TIMING_REPS 5
+#define SLOWDOWN_RERUNS 3
+
+/*
+ * Differential fuzz harness for the parser.
+ *
+ * Every input is one command line. It is lexed and checked by both the live
+ * parser (lex_line() and parse_errors() from libsshell) and the frozen
+ * reference in reference.c, and the harness aborts if they disagree on the
+ * error code or, for lines that lex, on any token. It also aborts if the live
+ * parser takes more than FUZZ_SLOWDOWN (default 4) times as long as the
+ * reference on an input that takes the reference at least 20 microseconds,
+ * to catch quadratic cases. A slowdown has to show up again on every one of
+ * a few re-runs, so a busy machine doesn't fail the run.
+ *
+ * Built with -DLIBFUZZER this is a libFuzzer target. Otherwise main() runs
+ * each file given on the command line, or stdin if there are none (the way
+ * AFL runs targets), or with `-r N [SEED]` N random lines.
+ */
+
+typedef ErrorType (*LexFn)(char *line, unsigned char *mask, Token tokens[]);
+typedef int (*CheckFn)(Token tokens[]);
+
+/* Output of one parser on one line. */
+typedef struct parse_run {
+    char line[CMDLINE_MAX];
+    unsigned char mask[CMDLINE_MAX];
+    Token tokens[CMDLINE_MAX + 1];
+    ErrorType lex_error;
+    int error;
+} ParseRun;
+
+double slowdown_limit;
+
+double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Runs one parser on input. Lexing works in place, so the line is copied
+ * first. */
+void parse_with(LexFn lex, CheckFn check, const char *input, ParseRun *run) {
+    strcpy(run->line, input);
+    run->lex_error = lex(run->line, run->mask, run->tokens);
+    run->error = run->lex_error;
+    if (run->lex_error == NO_ERROR) run->error = check(run->tokens);
+}
+
+/* Runs both parsers several times, alternating between them, and stores
+ * the fastest run of each in nanoseconds. */
+void time_parsers(const char *input, ParseRun *live, ParseRun *ref,
+                  double *t_live, double *t_ref) {
+    for (int i = 0; i < TIMING_REPS; i++) {
+        double start = now_ns();
+        parse_with(ref_lex_line, ref_parse_errors, input, ref);
+        double mid = now_ns();
+        parse_with(lex_line, parse_errors, input, live);
+        double end = now_ns();
+        if (!i || mid - start < *t_ref) *t_ref = mid - start;
+        if (!i || end - mid < *t_live) *t_live = end - mid;
+    }
+}
+
+void report_input(const char *what, const char *input) {
+    fprintf(stderr, "parser_fuzz: %s on input (%zu bytes): \"", what,
+            strlen(input));
+    for (const char *c = input; *c; c++) {
+        if (*c >= ' ' && *c < 127 && *c != '"' && *c != '\\')
+            fputc(*c, stderr);
+        else
+            fprintf(stderr, "\\x%02x", (unsigned char)*c);
+    }
+    fprintf(stderr, "\"\n");
+}
+
+/* Returns true if both runs produced the same tokens. */
+bool same_tokens(const ParseRun *a, const ParseRun *b) {
+    for (int i = 0;; i++) {
+        const Token *x = &a->tokens[i], *y = &b->tokens[i];
+        if (x->type != y->type || x->start != y->start || x->end != y->end)
+            return false;
+        if (x->type == TOK_END) return true;
+        if (x->type != TOK_WORD) continue;
+
+        if (x->word.kind != y->word.kind || x->word.quoted != y->word.quoted ||
+            strcmp(x->word.text, y->word.text))
+            return false;
+
+        /* Process substitution words are raw text without a mask. */
+        size_t len = strlen(x->word.text);
+        if (x->word.kind == WORD_PLAIN &&
+            memcmp(x->word.mask, y->word.mask, len))
+            return false;
+    }
+}
+
+/* Checks one command line. Aborts on a difference or a slowdown. */
+void check_line(const char *input) {
+    static ParseRun live, ref;
+
+    double t_live, t_ref;
+    time_parsers(input, &live, &ref, &t_live, &t_ref);
+
+    if (live.error != ref.error) {
+        report_input("error code differs", input);
+        fprintf(stderr, "parser_fuzz: live %d, reference %d\n", live.error,
+                ref.error);
+        abort();
+    }
+    if (live.lex_error == NO_ERROR && !same_tokens(&live, &ref)) {
+        report_input("tokens differ", input);
+        abort();
+    }
+    for (int i = 0; i < SLOWDOWN_RERUNS && t_ref >= TIMING_FLOOR_NS &&
+                    t_live > slowdown_limit * t_ref;
+         i++)
+        time_parsers(input, &live, &ref, &t_live, &t_ref);
+    if (t_ref >= TIMING_FLOOR_NS && t_live > slowdown_limit * t_ref) {
+        report_input("slowdown", input);
+        fprintf(stderr, "parser_fuzz: live %.0f ns, reference %.0f ns\n",
+                t_live, t_ref);
+        abort();
+    }
+}
+
+/* Turns fuzzer bytes into a command line: stops at the first NUL or newline
+ * (neither can reach the parser) and at the line length limit. */
+void check_bytes(const uint8_t *data, size_t size) {
+    char line[CMDLINE_MAX];
+    size_t n = 0;
+    while (n < size && n < CMDLINE_MAX - 1 && data[n] && data[n] != '\n') {
+        line[n] = data[n];
+        n++;
+    }
+    line[n] = '\0';
+    check_line(line);
+}
+
+void init_limits() {
+    const char *env = getenv("FUZZ_SLOWDOWN");
+    slowdown_limit = env ? atof(env) : SLOWDOWN_DEFAULT;
+    if (slowdown_limit <= 0) slowdown_limit = SLOWDOWN_DEFAULT;
+}
+
+#ifdef LIBFUZZER
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    if (!slowdown_limit) init_limits();
+    check_bytes(data, size);
+    return 0;
+}
+#else
+/* Pieces random lines are made of, weighted towards the parser's special
+ * characters. */
+const char *fragments[] = {
+    "a",   "ls",   "echo", " ",  "  ", "\t", "|",   "||",  "&",   "&&",
+    ";",   ">",    ">>",   "<",  "<<", "<<<", "'",  "\"",  "\\", "$",
+    "$(",  "<(",   ">(",   "(",  ")",  "x y", "*",  "$HOME", "'q q'",
+    "\"d $v\"",
+};
+
+void random_lines(long count, unsigned seed) {
+    size_t num_fragments = sizeof(fragments) / sizeof(fragments[0]);
+    char line[CMDLINE_MAX];
+    srand(seed);
+
+    for (long i = 0; i < count; i++) {
+        size_t len = 0;
+        int pieces = rand() % 200;
+        for (int j = 0; j < pieces; j++) {
+            const char *f = fragments[rand() % num_fragments];
+            size_t n = strlen(f);
+            if (len + n >= CMDLINE_MAX) break;
+            memcpy(line + len, f, n);
+            len += n;
+        }
+        line[len] = '\0';
+        check_line(line);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    static uint8_t buf[1 << 16];
+    init_limits();
+
+    if (argc > 2 && !strcmp(argv[1], "-r")) {
+        long count = atol(argv[2]);
+        unsigned seed = (argc > 3) ? (unsigned)atol(argv[3]) : 1;
+        random_lines(count, seed);
+        printf("parser_fuzz: %ld random lines match the reference\n", count);
+        return EXIT_SUCCESS;
+    }
+    if (argc == 1) {
+        size_t n = fread(buf, 1, sizeof(buf), stdin);
+        check_bytes(buf, n);
+        return EXIT_SUCCESS;
+    }
+    for (int i = 1; i < argc; i++) {
+        FILE *f = fopen(argv[i], "rb");
+        if (!f) {
+            perror(argv[i]);
+            return EXIT_FAILURE;
+        }
+        size_t n = fread(buf, 1, sizeof(buf), f);
+        fclose(f);
+        check_bytes(buf, n);
+    }
+    return EXIT_SUCCESS;
+}
+#endif
@@ -0,0 +1,261 @@
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <string.h>
+
+#include "reference.h"
+
+/*
+ * Frozen copy of the lexer and parse error DFA, as of the token-based
+ * parser. It was taken after the fix that made only `<(` and `>(` process
+ * substitutions, so it matches the live lexer as of then and guards against
+ * later regressions, not that bug. The fuzzer checks the live implementation
+ * in sshell.c against this one, so leave it alone when changing the parser:
+ * update it only when the parser's behavior is meant to change.
+ */
+
+/* Character class of every byte, used by the lexer. */
+const unsigned char ref_char_class[256] = {
+    ['\0'] = CC_END,      [' '] = CC_SPACE,     ['\t'] = CC_SPACE,
+    ['\n'] = CC_SPACE,    ['\v'] = CC_SPACE,    ['\f'] = CC_SPACE,
+    ['\r'] = CC_SPACE,    ['|'] = CC_OPERATOR,  ['&'] = CC_OPERATOR,
+    [';'] = CC_OPERATOR,  ['>'] = CC_OPERATOR,  ['<'] = CC_OPERATOR,
+    ['\''] = CC_QUOTE,    ['"'] = CC_QUOTE,     ['\\'] = CC_ESCAPE,
+};
+
+CharClass ref_class_of(char c) {
+    return (CharClass)ref_char_class[(unsigned char)c];
+}
+
+/* Reads the operator at s into *type and returns its length. Returns 0 for a
+ * lone `&` or `<`, which are part of a word. */
+int ref_lex_operator(const char *s, TokenType *type) {
+    switch (s[0]) {
+        case '|':
+            *type = (s[1] == '|') ? TOK_OR : TOK_PIPE;
+            return (s[1] == '|') ? 2 : 1;
+        case '&':
+            *type = TOK_AND;
+            return (s[1] == '&') ? 2 : 0;
+        case ';':
+            *type = TOK_SEMICOLON;
+            return 1;
+        case '>':
+            *type = (s[1] == '>') ? TOK_REDIRECT_APPEND : TOK_REDIRECT;
+            return (s[1] == '>') ? 2 : 1;
+        case '<':
+            if (s[1] != '<') return 0;
+            *type = (s[2] == '<') ? TOK_HERE_STRING : TOK_HERE_DOCUMENT;
+            return (s[2] == '<') ? 3 : 2;
+    }
+    return 0;
+}
+
+/* Returns the `)` closing the `(` at s, skipping quoted parts and nested
+ * parentheses, or NULL if there is none. */
+char *ref_find_closing_paren(char *s) {
+    int depth = 0;
+    for (; *s; s++) {
+        if (*s == '\\' && s[1]) {
+            s++;
+        } else if (*s == '\'' || *s == '"') {
+            char quote = *s++;
+            for (; *s && *s != quote; s++) {
+                if (quote == '"' && *s == '\\' && s[1]) s++;
+            }
+            if (!*s) return NULL;
+        } else if (*s == '(') {
+            depth++;
+        } else if (*s == ')' && --depth == 0) {
+            return s;
+        }
+    }
+    return NULL;
+}
+
+/* Copies the command substitution $(...) at r verbatim down to *w, so it can
+ * be lexed on its own at expansion, and marks it with flag in mask (parallel
+ * to line). Returns the position after it, or NULL if it is not
+ * terminated. */
+char *ref_lex_command_substitution(char *r, char **w, char *line,
+                                   unsigned char *mask, QuoteFlag flag) {
+    char *close = ref_find_closing_paren(r + 1);
+    if (!close) return NULL;
+
+    size_t n = close + 1 - r;
+    memmove(*w, r, n);
+    memset(mask + (*w - line), flag, n);
+    mask[*w - line + 1] |= SUBST_OPEN;
+    *w += n;
+    return r + n;
+}
+
+/* Splits line into tokens in a single pass, ending with a TOK_END token.
+ * Quotes and backslash escapes are removed in place, so words point into
+ * line, and mask (as long as line) receives the QuoteFlag of every character
+ * kept. */
+ErrorType ref_lex_line(char *line, unsigned char *mask, Token tokens[]) {
+    char *r = line;
+
+    /* A word directly followed by an operator can only be terminated once
+     * the operator has been read. */
+    char *pending_nul = NULL;
+
+    for (Token *t = tokens;; t++) {
+        while (ref_class_of(*r) == CC_SPACE) r++;
+        t->start = r - line;
+
+        if (*r == '\0') {
+            t->type = TOK_END;
+            t->end = t->start;
+            if (pending_nul) *pending_nul = '\0';
+            return NO_ERROR;
+        }
+
+        /* `<(` and `>(` start a process substitution, not an operator. */
+        bool proc_subst = (*r == '<' || *r == '>') && r[1] == '(';
+        int op_len;
+        if (ref_class_of(*r) == CC_OPERATOR && !proc_subst &&
+            (op_len = ref_lex_operator(r, &t->type))) {
+            r += op_len;
+            t->end = r - line;
+            if (pending_nul) *pending_nul = '\0';
+            pending_nul = NULL;
+            continue;
+        }
+
+        /* Word: copy characters down to w, dropping quotes and escapes. */
+        char *w = r;
+        t->type = TOK_WORD;
+        t->word.kind = WORD_PLAIN;
+        t->word.text = w;
+        t->word.mask = mask + (w - line);
+        t->word.quoted = false;
+
+        /* Process substitution: keep the inner command line untouched so it
+         * can be lexed on its own at launch. */
+        if (proc_subst) {
+            char *close = ref_find_closing_paren(r + 1);
+            if (!close) return PARSE_ERR_MISSING_PAREN;
+            t->word.kind = (*r == '<') ? WORD_PROC_IN : WORD_PROC_OUT;
+            t->word.text = r + 2;
+            *close = '\0';
+            r = close + 1;
+            t->end = r - line;
+            if (pending_nul) *pending_nul = '\0';
+            pending_nul = NULL;
+            continue;
+        }
+        while (1) {
+            CharClass cls = ref_class_of(*r);
+            TokenType unused;
+            if (*r == '$' && r[1] == '(') {
+                r = ref_lex_command_substitution(r, &w, line, mask, QUOTE_NONE);
+                if (!r) return PARSE_ERR_MISSING_PAREN;
+            } else if (cls == CC_WORD ||
+                       (cls == CC_OPERATOR && !ref_lex_operator(r, &unused))) {
+                mask[w - line] = QUOTE_NONE;
+                *w++ = *r++;
+            } else if (cls == CC_ESCAPE) {
+                /* A trailing backslash is kept as is. */
+                if (r[1]) r++;
+                mask[w - line] = QUOTE_SINGLE;
+                *w++ = *r++;
+                t->word.quoted = true;
+            } else if (cls == CC_QUOTE) {
+                char quote = *r++;
+                QuoteFlag flag = (quote == '\'') ? QUOTE_SINGLE : QUOTE_DOUBLE;
+                t->word.quoted = true;
+                while (*r != quote) {
+                    if (*r == '\0') return PARSE_ERR_UNTERMINATED_QUOTE;
+                    if (quote == '"' && *r == '$' && r[1] == '(') {
+                        r = ref_lex_command_substitution(r, &w, line, mask, flag);
+                        if (!r) return PARSE_ERR_MISSING_PAREN;
+                        continue;
+                    }
+                    QuoteFlag cur_flag = flag;
+                    /* Inside double quotes, a backslash only escapes these. */
+                    if (quote == '"' && *r == '\\' && r[1] &&
+                        strchr("\"\\$", r[1])) {
+                        r++;
+                        cur_flag = QUOTE_SINGLE;
+                    }
+                    mask[w - line] = cur_flag;
+                    *w++ = *r++;
+                }
+                r++;
+            } else {
+                break;
+            }
+        }
+        t->end = r - line;
+
+        if (w == r && ref_class_of(*r) == CC_OPERATOR) {
+            pending_nul = w;
+        } else {
+            /* Safe to overwrite: either already copied or whitespace. */
+            if (w == r && *r) r++;
+            *w = '\0';
+        }
+    }
+}
+
+/* Looks for all parse errors in the tokens of a command line. Uses a DFA. */
+int ref_parse_errors(Token tokens[]) {
+    ParseState state = SEEN_PIPE;
+
+    /* State to go back to once the here-string/document word is read. */
+    ParseState here_return = READING_PROCESS;
+
+    int num_args = 0, max_args = 0;
+    for (Token *t = tokens; t->type != TOK_END; t++) {
+        if (t->type == TOK_WORD) {
+            // Words after the output file are still arguments of the process.
+            if (state == SEEN_HERE) {
+                state = here_return;
+            } else if (state == SEEN_REDIRECT) {
+                state = READING_FILENAME;
+            } else {
+                if (state == SEEN_PIPE || state == SEEN_SEMICOLON)
+                    state = READING_PROCESS;
+                num_args++;
+            }
+            continue;
+        }
+
+        // Every operator needs a command before it...
+        if (state == SEEN_PIPE || state == SEEN_SEMICOLON)
+            return PARSE_ERR_MISSING_CMD;
+        // ...and an output file if it follows a redirection.
+        if (state == SEEN_REDIRECT) return PARSE_ERR_NO_OUTPUT;
+        if (state == SEEN_HERE) return PARSE_ERR_NO_HERE_INPUT;
+
+        if (t->type == TOK_HERE_STRING || t->type == TOK_HERE_DOCUMENT) {
+            here_return = state;
+            state = SEEN_HERE;
+            continue;
+        }
+
+        if (t->type == TOK_REDIRECT || t->type == TOK_REDIRECT_APPEND) {
+            if (state == READING_FILENAME) return PARSE_ERR_MISLOCATED_REDIR;
+            state = SEEN_REDIRECT;
+            continue;
+        }
+
+        if (t->type == TOK_PIPE) {
+            if (state == READING_FILENAME) return PARSE_ERR_MISLOCATED_REDIR;
+            state = SEEN_PIPE;
+        } else {
+            state = (t->type == TOK_SEMICOLON) ? SEEN_SEMICOLON : SEEN_PIPE;
+        }
+        max_args = (max_args > num_args) ? max_args : num_args;
+        num_args = 0;
+    }
+
+    max_args = (max_args > num_args) ? max_args : num_args;
+
+    if (state == SEEN_PIPE) return PARSE_ERR_MISSING_CMD;
+    if (state == SEEN_REDIRECT) return PARSE_ERR_NO_OUTPUT;
+    if (state == SEEN_HERE) return PARSE_ERR_NO_HERE_INPUT;
+    if (max_args > ARGS_MAX) return PARSE_ERR_ARG_OVERFLOW;
+    return NO_ERROR;
+}
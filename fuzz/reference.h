@@ -0,0 +1,11 @@
+#ifndef REFERENCE_H
+#define REFERENCE_H
+
+#include "sshell.h"
+
+/* Reference lexer and parse error check, with the same contracts as
+ * lex_line() and parse_errors(). */
+ErrorType ref_lex_line(char *line, unsigned char *mask, Token tokens[]);
+int ref_parse_errors(Token tokens[]);
+
+#endif
@@ -0,0 +1,96 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sshell.h"
+
+void usage() {
+    fprintf(stderr,
+            "usage: sshell [-bj] [-f fd | -l file] [-c command]\n"
+            "  -b       batch completion records\n"
+            "  -j       write completion records as NDJSON\n"
+            "  -f fd    write completion records to fd instead of stderr\n"
+            "  -l file  append completion records to file\n"
+            "  -c line  run one command line and exit with its status\n");
+}
+
+/* Parses the -f argument: an open file descriptor. Returns -1 if it isn't
+ * one. */
+int parse_fd(const char *arg) {
+    char *end;
+    long fd = strtol(arg, &end, 10);
+    if (end == arg || *end || fd < 0 || fd > INT_MAX) return -1;
+    if (fcntl(fd, F_GETFD) == -1) return -1;
+    return fd;
+}
+
+int main(int argc, char *argv[]) {
+    char input[CMDLINE_MAX];
+    const char *command = NULL;
+    int opt;
+
+    /* Builtins run inside the shell write to pipes, so a reader that has gone
+     * away must give them EPIPE rather than kill the shell. */
+    signal(SIGPIPE, SIG_IGN);
+
+    while ((opt = getopt(argc, argv, "bc:f:jl:")) != -1) {
+        switch (opt) {
+            case 'b':
+                reporter.batch = true;
+                break;
+            case 'c':
+                command = optarg;
+                break;
+            case 'f':
+                reporter.fd = parse_fd(optarg);
+                if (reporter.fd == -1) {
+                    fprintf(stderr, "sshell: -f: not an open file "
+                                    "descriptor: '%s'\n", optarg);
+                    usage();
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'j':
+                reporter.json = true;
+                break;
+            case 'l':
+                if (!report_open(optarg)) {
+                    perror(optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            default:
+                usage();
+                return EXIT_FAILURE;
+        }
+    }
+
+    /* `sshell -c LINE` runs one command line and exits with its status. */
+    if (command) {
+        if (strlen(command) >= CMDLINE_MAX) {
+            fprintf(stderr, "Error: command line too long\n");
+            return EXIT_FAILURE;
+        }
+        single_line = true;
+        strcpy(input, command);
+        bool ok = run_line(input);
+        report_flush();
+        return ok ? last_status : EXIT_FAILURE;
+    }
+
+    while (1) {
+        arena_reset(&cmd_arena);
+        report_idle();
+
+        /* Prompt user for input and store result. */
+        if (!prompt_get_input(input)) break;
+        run_line(input);
+    }
+
+    report_flush();
+    return EXIT_SUCCESS;
+}
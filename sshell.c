@@ -1,76 +1,66 @@
+#define _GNU_SOURCE
 #include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
 #include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-#define CMDLINE_MAX 512
-#define PT_MAX 512
-#define ARGS_MAX 16
-
-typedef enum cmd_type {
-    BUILTIN_EXIT,
-    BUILTIN_CD,
-    BUILTIN_PWD,
-    NOT_BUILTIN
-} CmdType;
-
-typedef enum error_type {
-    PARSE_ERR_ARG_OVERFLOW,
-    PARSE_ERR_MISSING_CMD,
-    PARSE_ERR_NO_OUTPUT,
-    PARSE_ERR_MISLOCATED_REDIR,
-    LAUNCH_ERR_ACCESS_DIR,
-    LAUNCH_ERR_ACCESS_FILE,
-    LAUNCH_ERR_CMD_NOT_FOUND,
-    NO_ERROR
-} ErrorType;
-
-typedef enum redirect_type {
-    NO_REDIRECT,
-    REDIRECT_TRUNCATE,
-    REDIRECT_APPEND
-} RedirectType;
-
-/* Possible parsing states. Used for parse_errors function. */
-typedef enum parse_state {
-    SEEN_PIPE,  // start state
-    SEEN_ONE_ARR,
-    SEEN_TWO_ARR,
-    READING_PROCESS_WHITESPACE,
-    READING_PROCESS_ARGS,
-    READING_FILENAME,
-    READING_FILENAME_WHITESPACE
-} ParseState;
-
-typedef struct process {
-    pid_t pid;
-    int exit_val;
-
-    /* Process command (equal to args[0]). */
-    char *cmd;
-
-    /* Process arguments. */
-    char *args[ARGS_MAX + 1];
-
-    RedirectType redirect_output;
-    char *filename;
-
-    /* File descriptors for input/output streams. */
-    int in, out;
-
-    /* Dynamically allocated copy of process string. Saved so it can be
-     * deallocated later. */
-    char *token_copy;
-
-    struct process *next;
-} Process;
+#include "sshell.h"
+
+Arena cmd_arena;
+
+/* Most recently used directory indexes first. */
+DirIndex *dir_cache;
+
+/* Status of the last pipeline that ran, for `$?`. */
+int last_status;
+
+/* Set in the forked shell that runs a process substitution. */
+bool in_subshell;
+
+History history;
+
+PathCache path_cache;
+
+/* Set by `-c`. The shell runs a single line, so caches that only pay off on
+ * later lines aren't filled. */
+bool single_line;
+
+Reporter reporter = {.fd = STDERR_FILENO};
+
+/* Commands run by the shell itself, offered by completion. */
+const char *builtins[] = {"cd",         "count", "exit",  "field", "head",
+                          "pipe-split", "pmap",  "pwd",   "set",   "sls",
+                          "sort",       "stats", "tee",   "wc",    NULL};
+
+Stats stats;
+ShellOptions options;
+EventLoop loop;
+ThreadPool pool = {.lock = PTHREAD_MUTEX_INITIALIZER};
 
 /* Prints error message based on error type. */
 void handle_error(ErrorType e) {
@@ -87,6 +77,15 @@ void handle_error(ErrorType e) {
         case PARSE_ERR_MISLOCATED_REDIR:
             fprintf(stderr, "Error: mislocated output redirection\n");
             break;
+        case PARSE_ERR_UNTERMINATED_QUOTE:
+            fprintf(stderr, "Error: unterminated quote\n");
+            break;
+        case PARSE_ERR_NO_HERE_INPUT:
+            fprintf(stderr, "Error: no here-document input\n");
+            break;
+        case PARSE_ERR_MISSING_PAREN:
+            fprintf(stderr, "Error: missing closing parenthesis\n");
+            break;
         case LAUNCH_ERR_ACCESS_DIR:
             fprintf(stderr, "Error: cannot cd into directory\n");
             break;
@@ -96,72 +95,260 @@ void handle_error(ErrorType e) {
         case LAUNCH_ERR_CMD_NOT_FOUND:
             fprintf(stderr, "Error: command not found\n");
             break;
+        case LAUNCH_ERR_HERE_INPUT:
+            fprintf(stderr, "Error: cannot create here-document\n");
+            break;
+        case LAUNCH_ERR_BAD_OPTION:
+            fprintf(stderr, "Error: invalid option\n");
+            break;
         case NO_ERROR:
             fprintf(stderr, "THIS SHOULDN'T PRINT! NO ERROR\n");
             break;
     }
 }
 
-/* Looks for all parse errors in input. Uses a DFA. */
-int parse_errors(char *input) {
+/* Character class of every byte, used by the lexer. */
+const unsigned char char_class[256] = {
+    ['\0'] = CC_END,      [' '] = CC_SPACE,     ['\t'] = CC_SPACE,
+    ['\n'] = CC_SPACE,    ['\v'] = CC_SPACE,    ['\f'] = CC_SPACE,
+    ['\r'] = CC_SPACE,    ['|'] = CC_OPERATOR,  ['&'] = CC_OPERATOR,
+    [';'] = CC_OPERATOR,  ['>'] = CC_OPERATOR,  ['<'] = CC_OPERATOR,
+    ['\''] = CC_QUOTE,    ['"'] = CC_QUOTE,     ['\\'] = CC_ESCAPE,
+};
+
+CharClass class_of(char c) { return (CharClass)char_class[(unsigned char)c]; }
+
+/* Reads the operator at s into *type and returns its length. Returns 0 for a
+ * lone `&` or `<`, which are part of a word. */
+int lex_operator(const char *s, TokenType *type) {
+    switch (s[0]) {
+        case '|':
+            *type = (s[1] == '|') ? TOK_OR : TOK_PIPE;
+            return (s[1] == '|') ? 2 : 1;
+        case '&':
+            *type = TOK_AND;
+            return (s[1] == '&') ? 2 : 0;
+        case ';':
+            *type = TOK_SEMICOLON;
+            return 1;
+        case '>':
+            *type = (s[1] == '>') ? TOK_REDIRECT_APPEND : TOK_REDIRECT;
+            return (s[1] == '>') ? 2 : 1;
+        case '<':
+            if (s[1] != '<') return 0;
+            *type = (s[2] == '<') ? TOK_HERE_STRING : TOK_HERE_DOCUMENT;
+            return (s[2] == '<') ? 3 : 2;
+    }
+    return 0;
+}
+
+/* Returns the `)` closing the `(` at s, skipping quoted parts and nested
+ * parentheses, or NULL if there is none. */
+char *find_closing_paren(char *s) {
+    int depth = 0;
+    for (; *s; s++) {
+        if (*s == '\\' && s[1]) {
+            s++;
+        } else if (*s == '\'' || *s == '"') {
+            char quote = *s++;
+            for (; *s && *s != quote; s++) {
+                if (quote == '"' && *s == '\\' && s[1]) s++;
+            }
+            if (!*s) return NULL;
+        } else if (*s == '(') {
+            depth++;
+        } else if (*s == ')' && --depth == 0) {
+            return s;
+        }
+    }
+    return NULL;
+}
+
+/* Copies the command substitution $(...) at r verbatim down to *w, so it can
+ * be lexed on its own at expansion, and marks it with flag in mask (parallel
+ * to line), its `(` also with SUBST_OPEN. Returns the position after it, or
+ * NULL if it is not terminated. */
+char *lex_command_substitution(char *r, char **w, char *line,
+                               unsigned char *mask, QuoteFlag flag) {
+    char *close = find_closing_paren(r + 1);
+    if (!close) return NULL;
+
+    size_t n = close + 1 - r;
+    memmove(*w, r, n);
+    memset(mask + (*w - line), flag, n);
+    mask[*w - line + 1] |= SUBST_OPEN;
+    *w += n;
+    return r + n;
+}
+
+/* Splits line into tokens in a single pass, ending with a TOK_END token.
+ * Quotes and backslash escapes are removed in place, so words point into
+ * line, and mask (as long as line) receives the QuoteFlag of every character
+ * kept. */
+ErrorType lex_line(char *line, unsigned char *mask, Token tokens[]) {
+    char *r = line;
+
+    /* A word directly followed by an operator can only be terminated once
+     * the operator has been read. */
+    char *pending_nul = NULL;
+
+    for (Token *t = tokens;; t++) {
+        while (class_of(*r) == CC_SPACE) r++;
+        t->start = r - line;
+
+        if (*r == '\0') {
+            t->type = TOK_END;
+            t->end = t->start;
+            if (pending_nul) *pending_nul = '\0';
+            return NO_ERROR;
+        }
+
+        /* `<(` and `>(` start a process substitution, not an operator. */
+        bool proc_subst = (*r == '<' || *r == '>') && r[1] == '(';
+        int op_len;
+        if (class_of(*r) == CC_OPERATOR && !proc_subst &&
+            (op_len = lex_operator(r, &t->type))) {
+            r += op_len;
+            t->end = r - line;
+            if (pending_nul) *pending_nul = '\0';
+            pending_nul = NULL;
+            continue;
+        }
+
+        /* Word: copy characters down to w, dropping quotes and escapes. */
+        char *w = r;
+        t->type = TOK_WORD;
+        t->word.kind = WORD_PLAIN;
+        t->word.text = w;
+        t->word.mask = mask + (w - line);
+        t->word.quoted = false;
+
+        /* Process substitution: keep the inner command line untouched so it
+         * can be lexed on its own at launch. */
+        if (proc_subst) {
+            char *close = find_closing_paren(r + 1);
+            if (!close) return PARSE_ERR_MISSING_PAREN;
+            t->word.kind = (*r == '<') ? WORD_PROC_IN : WORD_PROC_OUT;
+            t->word.text = r + 2;
+            *close = '\0';
+            r = close + 1;
+            t->end = r - line;
+            if (pending_nul) *pending_nul = '\0';
+            pending_nul = NULL;
+            continue;
+        }
+        while (1) {
+            CharClass cls = class_of(*r);
+            TokenType unused;
+            if (*r == '$' && r[1] == '(') {
+                r = lex_command_substitution(r, &w, line, mask, QUOTE_NONE);
+                if (!r) return PARSE_ERR_MISSING_PAREN;
+            } else if (cls == CC_WORD ||
+                       (cls == CC_OPERATOR && !lex_operator(r, &unused))) {
+                mask[w - line] = QUOTE_NONE;
+                *w++ = *r++;
+            } else if (cls == CC_ESCAPE) {
+                /* A trailing backslash is kept as is. */
+                if (r[1]) r++;
+                mask[w - line] = QUOTE_SINGLE;
+                *w++ = *r++;
+                t->word.quoted = true;
+            } else if (cls == CC_QUOTE) {
+                char quote = *r++;
+                QuoteFlag flag = (quote == '\'') ? QUOTE_SINGLE : QUOTE_DOUBLE;
+                t->word.quoted = true;
+                while (*r != quote) {
+                    if (*r == '\0') return PARSE_ERR_UNTERMINATED_QUOTE;
+                    if (quote == '"' && *r == '$' && r[1] == '(') {
+                        r = lex_command_substitution(r, &w, line, mask, flag);
+                        if (!r) return PARSE_ERR_MISSING_PAREN;
+                        continue;
+                    }
+                    QuoteFlag cur_flag = flag;
+                    /* Inside double quotes, a backslash only escapes these. */
+                    if (quote == '"' && *r == '\\' && r[1] &&
+                        strchr("\"\\$", r[1])) {
+                        r++;
+                        cur_flag = QUOTE_SINGLE;
+                    }
+                    mask[w - line] = cur_flag;
+                    *w++ = *r++;
+                }
+                r++;
+            } else {
+                break;
+            }
+        }
+        t->end = r - line;
+
+        if (w == r && class_of(*r) == CC_OPERATOR) {
+            pending_nul = w;
+        } else {
+            /* Safe to overwrite: either already copied or whitespace. */
+            if (w == r && *r) r++;
+            *w = '\0';
+        }
+    }
+}
+
+/* Looks for all parse errors in the tokens of a command line. Uses a DFA. */
+int parse_errors(Token tokens[]) {
     ParseState state = SEEN_PIPE;
+
+    /* State to go back to once the here-string/document word is read. */
+    ParseState here_return = READING_PROCESS;
+
     int num_args = 0, max_args = 0;
-    for (int i = 0; input[i]; i++) {
-        char curr = input[i];
-        /* Factored out reading whitespace characters since behavior for most
-         * states is the same: stay in the same state. */
-        if (isspace(curr)) {
-            if (state == READING_PROCESS_ARGS || state == SEEN_PIPE) {
-                state = READING_PROCESS_WHITESPACE;
-            } else if (state == SEEN_ONE_ARR || state == SEEN_TWO_ARR) {
-                state = READING_FILENAME_WHITESPACE;
-            }
-        } else if (state == SEEN_PIPE) {
-            if (curr == '|' || curr == '>') return PARSE_ERR_MISSING_CMD;
-
-            state = READING_PROCESS_ARGS;
-            num_args++;
-        } else if (state == SEEN_ONE_ARR) {
-            if (curr == '|') return PARSE_ERR_NO_OUTPUT;
-
-            if (curr == '>')
-                state = SEEN_TWO_ARR;
-            else
-                state = READING_FILENAME;
-        } else if (state == SEEN_TWO_ARR) {
-            if (curr == '|' || curr == '>')
-                return PARSE_ERR_NO_OUTPUT;
-            else
+    for (Token *t = tokens; t->type != TOK_END; t++) {
+        if (t->type == TOK_WORD) {
+            // Words after the output file are still arguments of the process.
+            if (state == SEEN_HERE) {
+                state = here_return;
+            } else if (state == SEEN_REDIRECT) {
                 state = READING_FILENAME;
-        } else if (state == READING_PROCESS_WHITESPACE ||
-                   state == READING_PROCESS_ARGS) {
-            // `|` and `>` transitions are shared between both reading process
-            // states.
-            if (curr == '|' || curr == '>') {
-                state = (curr == '|') ? SEEN_PIPE : SEEN_ONE_ARR;
-                max_args = (max_args > num_args) ? max_args : num_args;
-                num_args = 0;
-            }
-            // Switch to reading args if not reading { |, >, (whitespace) }
-            // character in READING_PROCESS_WHITESPACE state.
-            else if (state == READING_PROCESS_WHITESPACE) {
+            } else {
+                if (state == SEEN_PIPE || state == SEEN_SEMICOLON)
+                    state = READING_PROCESS;
                 num_args++;
-                state = READING_PROCESS_ARGS;
             }
-        } else if (state == READING_FILENAME ||
-                   state == READING_FILENAME_WHITESPACE) {
-            if (curr == '|' || curr == '>') return PARSE_ERR_MISLOCATED_REDIR;
-            state = READING_FILENAME;
+            continue;
+        }
+
+        // Every operator needs a command before it...
+        if (state == SEEN_PIPE || state == SEEN_SEMICOLON)
+            return PARSE_ERR_MISSING_CMD;
+        // ...and an output file if it follows a redirection.
+        if (state == SEEN_REDIRECT) return PARSE_ERR_NO_OUTPUT;
+        if (state == SEEN_HERE) return PARSE_ERR_NO_HERE_INPUT;
+
+        if (t->type == TOK_HERE_STRING || t->type == TOK_HERE_DOCUMENT) {
+            here_return = state;
+            state = SEEN_HERE;
+            continue;
         }
+
+        if (t->type == TOK_REDIRECT || t->type == TOK_REDIRECT_APPEND) {
+            if (state == READING_FILENAME) return PARSE_ERR_MISLOCATED_REDIR;
+            state = SEEN_REDIRECT;
+            continue;
+        }
+
+        if (t->type == TOK_PIPE) {
+            if (state == READING_FILENAME) return PARSE_ERR_MISLOCATED_REDIR;
+            state = SEEN_PIPE;
+        } else {
+            state = (t->type == TOK_SEMICOLON) ? SEEN_SEMICOLON : SEEN_PIPE;
+        }
+        max_args = (max_args > num_args) ? max_args : num_args;
+        num_args = 0;
     }
 
     max_args = (max_args > num_args) ? max_args : num_args;
 
     if (state == SEEN_PIPE) return PARSE_ERR_MISSING_CMD;
-    if (state == SEEN_ONE_ARR || state == SEEN_TWO_ARR ||
-        state == READING_FILENAME_WHITESPACE)
-        return PARSE_ERR_NO_OUTPUT;
-    if (max_args > 16) return PARSE_ERR_ARG_OVERFLOW;
+    if (state == SEEN_REDIRECT) return PARSE_ERR_NO_OUTPUT;
+    if (state == SEEN_HERE) return PARSE_ERR_NO_HERE_INPUT;
+    if (max_args > ARGS_MAX) return PARSE_ERR_ARG_OVERFLOW;
     return NO_ERROR;
 }
 
@@ -190,278 +377,4860 @@ void close_pipes(Process *head) {
 
         if (cur->out != STDOUT_FILENO) close(cur->out);
 
+        if (cur->here_fd != -1) close(cur->here_fd);
+
         cur = cur->next;
     }
 }
 
+/* Closes the shell's ends of the process substitution pipes once the
+ * processes using them have been launched. */
+void close_substitutions(Process *head) {
+    for (Process *cur = head; cur; cur = cur->next) {
+        /* Builtins still need theirs; see finish_builtin(). */
+        if (cur->builtin) continue;
+        for (int i = 0; i < cur->num_substs; i++) close(cur->subst_fds[i]);
+    }
+}
+
+/* Closes the shell's ends of the pipes to a pipe-split stage's workers that
+ * the builtin hasn't taken over. */
+void close_workers(Process *p) {
+    for (Process *w = p->workers; w && w != p; w = w->next) {
+        if (w->feed_fd != -1) close(w->feed_fd);
+        if (w->drain_fd != -1) close(w->drain_fd);
+        w->feed_fd = w->drain_fd = -1;
+    }
+}
+
 /* Sets up file streams (pipes and output redirection) before executing process.
  * Head is used to check which fds are open. */
 bool setup_fd_table(Process *p, Process *head) {
-    dup2(p->in, STDIN_FILENO);
+    /* A here-string/document takes precedence over the pipe. */
+    if (p->here_fd != -1)
+        dup2(p->here_fd, STDIN_FILENO);
+    else
+        dup2(p->in, STDIN_FILENO);
 
     if (p->redirect_output == NO_REDIRECT)
         dup2(p->out, STDOUT_FILENO);
     else {
-        if (!redirect_stdout(p->filename, p->redirect_output)) return false;
+        if (!redirect_stdout(p->output_path, p->redirect_output))
+            return false;
     }
 
     close_pipes(head);
+
+    /* Substitution fds are close-on-exec in the shell; only this process
+     * keeps its own. */
+    for (int i = 0; i < p->num_substs; i++) fcntl(p->subst_fds[i], F_SETFD, 0);
     return true;
 }
 
-/* Splits command line input into process strings using "|" delimiter. Modifies
- * original string. */
-void tokenize_processes(char str[], char *process_tokens[]) {
-    char *token = strtok(str, "|");
-
-    int token_count = 0;
+/* Runs in a freshly forked child: sets up the fds of p, a stage of the
+ * pipeline at head, and execs its command. Never returns. */
+void exec_stage(Process *p, Process *head) {
+    /* The shell ignores SIGPIPE for its builtins' sake. */
+    signal(SIGPIPE, SIG_DFL);
 
-    while (token) {
-        process_tokens[token_count] = token;
-        token_count++;
-        token = strtok(NULL, "|");
+    /* Here we need to call exit since we're in the child process. */
+    /* _exit() so stdio doesn't seek a stdin shared with the shell back to
+     * what the shell has buffered. */
+    if (!setup_fd_table(p, head)) {
+        handle_error(LAUNCH_ERR_ACCESS_FILE);
+        _exit(EXIT_FAILURE);
     }
 
-    process_tokens[token_count] = NULL;
+    /* A stale hash entry falls back to searching PATH. */
+    if (p->exec_path) execv(p->exec_path, p->argv);
+    execvp(p->cmd, p->argv);
+    handle_error(LAUNCH_ERR_CMD_NOT_FOUND);
+    _exit(EXIT_FAILURE);
 }
 
-/* Splits process string into arguments using " " delimiter. Modifies original
- * string. */
-void tokenize_cmd(char cmd[], char *buf[]) {
-    /* Get rid of trailing filename and output redirection stuff. */
+/* Checks if a token ends a pipeline. */
+bool ends_pipeline(TokenType type) {
+    return type == TOK_SEMICOLON || type == TOK_AND || type == TOK_OR ||
+           type == TOK_END;
+}
 
-    int i = 0;
-    while (cmd[i] != '\0') {
-        if (cmd[i] == '>') {
-            cmd[i] = '\0';
-            break;
+/* Initializes the process linked list of the pipeline starting at *tok and
+ * leaves *tok on the token that ends it. Does not set up any pipes or fds. */
+Process *initialize_processes(Token **tok) {
+    Token *t = *tok;
+    Process *head = NULL;
+    Process *cur = NULL;
+
+    while (1) {
+        Process *next = (Process *)calloc(1, sizeof(Process));
+        next->pid = -1;
+        next->in = STDIN_FILENO;
+        next->out = STDOUT_FILENO;
+        next->redirect_output = NO_REDIRECT;
+        next->here_type = NO_HERE;
+        next->here_fd = -1;
+
+        if (!head)
+            head = next;
+        else
+            cur->next = next;
+        cur = next;
+
+        for (; t->type != TOK_PIPE && !ends_pipeline(t->type); t++) {
+            if (t->type == TOK_WORD) {
+                cur->args[cur->num_args++] = t->word;
+            } else if (t->type == TOK_HERE_STRING ||
+                       t->type == TOK_HERE_DOCUMENT) {
+                cur->here_type = (t->type == TOK_HERE_STRING) ? HERE_STRING
+                                                              : HERE_DOCUMENT;
+                cur->here_word = (++t)->word;
+            } else {
+                /* Handle output redirection (both types) */
+                cur->redirect_output = (t->type == TOK_REDIRECT_APPEND)
+                                           ? REDIRECT_APPEND
+                                           : REDIRECT_TRUNCATE;
+                cur->filename = (++t)->word;
+            }
         }
-        i++;
+        cur->args[cur->num_args].text = NULL;
+        cur->cmd = cur->args[0].text;
+
+        if (t->type != TOK_PIPE) break;
+        t++;
     }
 
-    i = 0;
-    char whitespace_delimiters[] = " \f\n\r\t\v";
-    char *token = strtok(cmd, whitespace_delimiters);
-    while (token) {
-        buf[i++] = token;
-        token = strtok(NULL, whitespace_delimiters);
+    *tok = t;
+    return head;
+}
+
+/* Allocates n bytes from the arena. Memory lives until the next
+ * arena_reset(). */
+void *arena_alloc(Arena *a, size_t n) {
+    n = (n + 15) & ~(size_t)15;
+    ArenaChunk *c = a->head;
+    if (!c || c->used + n > c->size) {
+        size_t size = (n > ARENA_CHUNK_SIZE) ? n : ARENA_CHUNK_SIZE;
+        c = (ArenaChunk *)malloc(sizeof(ArenaChunk) + size);
+        c->size = size;
+        c->used = 0;
+        c->next = a->head;
+        a->head = c;
     }
+    void *p = c->data + c->used;
+    c->used += n;
+    return p;
+}
+
+char *arena_strndup(Arena *a, const char *s, size_t n) {
+    char *p = (char *)arena_alloc(a, n + 1);
+    memcpy(p, s, n);
+    p[n] = '\0';
+    return p;
+}
 
-    buf[i] = NULL;
+/* Releases everything allocated from the arena, keeping one chunk around for
+ * the next command line. */
+void arena_reset(Arena *a) {
+    ArenaChunk *c = a->head;
+    if (!c) return;
+    while (c->next) {
+        ArenaChunk *next = c->next;
+        free(c);
+        c = next;
+    }
+    c->used = 0;
+    a->head = c;
 }
 
-/* Checks if fd is open. */
-bool fd_is_open(int fd) { return fcntl(fd, F_GETFD) != -1; }
+/* Releases everything allocated from the arena, the last chunk too. */
+void arena_free(Arena *a) {
+    arena_reset(a);
+    free(a->head);
+    a->head = NULL;
+}
 
-/* Initializes process linked list. Does not set up any pipes or fds. */
-Process *initialize_processes(char *process_tokens[]) {
-    int i = 0;
-    Process *head = NULL;
-    Process *cur = NULL;
-    while (process_tokens[i]) {
-        char *cur_token = process_tokens[i];
+void argvec_push(ArgVec *v, char *s) {
+    if (v->len + 1 >= v->cap) {
+        size_t cap = v->cap ? v->cap * 2 : ARGS_MAX + 1;
+        char **items = (char **)arena_alloc(&cmd_arena, cap * sizeof(char *));
+        if (v->len) memcpy(items, v->items, v->len * sizeof(char *));
+        v->items = items;
+        v->cap = cap;
+    }
+    v->items[v->len++] = s;
+    v->items[v->len] = NULL;
+}
 
-        /* Using this to look for output redirection symbols and filenames. */
-        char *cur_token_copy = strdup(cur_token);
+bool is_glob_char(char c) { return c == '*' || c == '?' || c == '['; }
 
-        Process *next = (Process *)malloc(sizeof(Process));
-        tokenize_cmd(cur_token, next->args);
-        next->cmd = next->args[0];
-        next->exit_val = 0;
-        next->next = NULL;
+/* Checks if the first n characters of a word contain an unquoted glob
+ * character. */
+bool has_glob_chars(const char *text, const unsigned char *mask, size_t n) {
+    for (size_t i = 0; i < n && text[i]; i++) {
+        if (mask[i] == QUOTE_NONE && is_glob_char(text[i])) return true;
+    }
+    return false;
+}
 
-        /* Saving this to free later. */
-        next->token_copy = cur_token_copy;
+/* Returns the length of the variable name starting at s ("?" and "$" are
+ * the special parameters). */
+size_t var_name_len(const char *s) {
+    if (*s == '?' || *s == '$') return 1;
+    if (!isalpha(*s) && *s != '_') return 0;
+    size_t n = 1;
+    while (isalnum(s[n]) || s[n] == '_') n++;
+    return n;
+}
 
-        if (!head)
-            head = next;
-        else
-            cur->next = next;
-        cur = next;
+/* Appends a character and its quoting flag to a word being built in the
+ * command arena. */
+void word_buf_putc(WordBuf *b, char c, unsigned char flag) {
+    if (b->len + 1 >= b->cap) {
+        size_t cap = b->cap ? b->cap * 2 : CMDLINE_MAX;
+        char *text = (char *)arena_alloc(&cmd_arena, cap);
+        unsigned char *mask = (unsigned char *)arena_alloc(&cmd_arena, cap);
+        memcpy(text, b->text, b->len);
+        memcpy(mask, b->mask, b->len);
+        b->text = text;
+        b->mask = mask;
+        b->cap = cap;
+    }
+    b->text[b->len] = c;
+    b->mask[b->len++] = flag;
+    b->text[b->len] = '\0';
+}
+
+/* Appends n characters sharing one quoting flag to b. */
+void word_buf_append(WordBuf *b, const char *s, size_t n, unsigned char flag) {
+    if (b->len + n + 1 > b->cap) {
+        size_t cap = b->cap ? b->cap : CMDLINE_MAX;
+        while (b->len + n + 1 > cap) cap *= 2;
+        char *text = (char *)arena_alloc(&cmd_arena, cap);
+        unsigned char *mask = (unsigned char *)arena_alloc(&cmd_arena, cap);
+        memcpy(text, b->text, b->len);
+        memcpy(mask, b->mask, b->len);
+        b->text = text;
+        b->mask = mask;
+        b->cap = cap;
+    }
+    memcpy(b->text + b->len, s, n);
+    memset(b->mask + b->len, flag, n);
+    b->len += n;
+    b->text[b->len] = '\0';
+}
 
-        cur->in = STDIN_FILENO;
-        cur->out = STDOUT_FILENO;
+/* Appends the value of a variable to b. The value is marked as quoted so it
+ * is never globbed. */
+void append_var(WordBuf *b, const char *name, size_t name_len) {
+    char num[32];
+    const char *val;
+    if (name_len == 1 && *name == '?') {
+        snprintf(num, sizeof(num), "%d", last_status);
+        val = num;
+    } else if (name_len == 1 && *name == '$') {
+        snprintf(num, sizeof(num), "%d", (int)getpid());
+        val = num;
+    } else {
+        char key[CMDLINE_MAX];
+        snprintf(key, sizeof(key), "%.*s", (int)name_len, name);
+        val = getenv(key);
+        if (!val) return;
+    }
 
-        /* Handle output redirection (both types) */
-        cur->redirect_output = NO_REDIRECT;
+    word_buf_append(b, val, strlen(val), QUOTE_SINGLE);
+}
 
-        if (strstr(cur_token_copy, ">")) {
-            if (strstr(cur_token_copy, ">>"))
-                cur->redirect_output = REDIRECT_APPEND;
-            else
-                cur->redirect_output = REDIRECT_TRUNCATE;
-            process_tokens[i] = strtok(cur_token_copy, ">");
-            char whitespace_and_redir[] = "> \f\n\r\t\v";
-            cur->filename = strtok(NULL, whitespace_and_redir);
+bool command_substitution(const char *body, size_t len, WordBuf *b,
+                          bool split);
+
+/* Expands $NAME, ${NAME}, $?, $$ and $(cmd) outside single quotes. Returns
+ * false if the word expanded to nothing and should be dropped. */
+bool expand_vars(const Word *w, Word *out) {
+    const char *text = w->text;
+    const unsigned char *mask = w->mask;
+
+    *out = *w;
+    const char *dollar = strchr(text, '$');
+    if (!dollar) return text[0] || w->quoted;
+
+    WordBuf b = {NULL, NULL, 0, 0};
+    for (size_t i = 0; text[i];) {
+        size_t n;
+        const char *close;
+        if (text[i] != '$' || mask[i] == QUOTE_SINGLE) {
+            word_buf_putc(&b, text[i], mask[i]);
+            i++;
+        } else if (text[i + 1] == '(' && (mask[i + 1] & SUBST_OPEN) &&
+                   (close = find_closing_paren((char *)text + i + 1))) {
+            /* Any other `$(` is kept as it is. */
+            const char *body = text + i + 2;
+            command_substitution(body, close - body, &b,
+                                 mask[i] == QUOTE_NONE);
+            i = close + 1 - text;
+        } else if (text[i + 1] == '{' && (n = var_name_len(text + i + 2)) &&
+                   text[i + 2 + n] == '}') {
+            append_var(&b, text + i + 2, n);
+            i += n + 3;
+        } else if ((n = var_name_len(text + i + 1))) {
+            append_var(&b, text + i + 1, n);
+            i += n + 1;
+        } else {
+            word_buf_putc(&b, text[i], mask[i]);
+            i++;
         }
+    }
 
-        i++;
+    if (!b.len) {
+        if (!w->quoted) return false;
+        word_buf_putc(&b, '\0', QUOTE_NONE);
+        b.len = 0;
     }
+    out->text = b.text;
+    out->mask = b.mask;
+    return true;
+}
 
-    return head;
+int compare_names(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
 }
 
-/* Implements the builtin sls command. */
-void sls() {
-    DIR *dir;
-    struct dirent *dp;
+void free_dir_index(DirIndex *idx) {
+    free(idx->names);
+    free(idx->blob);
+    free(idx);
+}
+
+/* Reads every entry of the open directory fd with getdents64 into a new
+ * index, sorted by name. "." and ".." are left out. Each name in the blob is
+ * preceded by its d_type byte (see dir_entry_type()). */
+DirIndex *build_dir_index(int fd) {
+    size_t blob_cap = 16384, blob_len = 0;
+    size_t cap = 256, count = 0;
+    char *blob = (char *)malloc(blob_cap);
+    size_t *offsets = (size_t *)malloc(cap * sizeof(size_t));
+    char buf[DIRENT_BUF_SIZE];
+    ssize_t nread;
+
+    while ((nread = getdents64(fd, buf, sizeof(buf))) > 0) {
+        for (ssize_t pos = 0; pos < nread;) {
+            struct dirent64 *d = (struct dirent64 *)(buf + pos);
+            pos += d->d_reclen;
+            if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, "..")) continue;
+
+            size_t n = strlen(d->d_name) + 2;
+            if (blob_len + n > blob_cap) {
+                while (blob_len + n > blob_cap) blob_cap *= 2;
+                blob = (char *)realloc(blob, blob_cap);
+            }
+            if (count == cap) {
+                cap *= 2;
+                offsets = (size_t *)realloc(offsets, cap * sizeof(size_t));
+            }
+            blob[blob_len] = (char)d->d_type;
+            memcpy(blob + blob_len + 1, d->d_name, n - 1);
+            offsets[count++] = blob_len + 1;
+            blob_len += n;
+        }
+    }
+
+    /* Names are only pointed to once the blob stops moving. */
+    DirIndex *idx = (DirIndex *)calloc(1, sizeof(DirIndex));
+    idx->blob = blob;
+    idx->count = count;
+    idx->names = (char **)malloc((count + 1) * sizeof(char *));
+    for (size_t i = 0; i < count; i++) idx->names[i] = blob + offsets[i];
+    qsort(idx->names, count, sizeof(char *), compare_names);
+
+    free(offsets);
+    return idx;
+}
+
+/* Returns the d_type recorded for a name from a DirIndex. */
+unsigned char dir_entry_type(const char *name) {
+    return (unsigned char)name[-1];
+}
+
+/* Returns the sorted name index of directory dir, rescanning it only if its
+ * mtime changed since it was cached. Returns NULL if dir can't be read. */
+DirIndex *get_dir_index(const char *dir) {
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) return NULL;
+
     struct stat sb;
-    dir = opendir(".");
-    if (dir == NULL) {
-        handle_error(LAUNCH_ERR_ACCESS_DIR);
-        exit(EXIT_FAILURE);
+    if (fstat(fd, &sb) == -1) {
+        close(fd);
+        return NULL;
     }
-    while ((dp = readdir(dir)) != NULL) {
-        if (dp->d_name[0] != '.')  // Exclude hidden files
-        {
-            char filename[PT_MAX];
-            snprintf(filename, PT_MAX, "%s/%s", ".", dp->d_name);
-            if (stat(filename, &sb) == 0) {
-                printf("%s (%lld bytes)\n", dp->d_name, (long long)sb.st_size);
+
+    DirIndex **link = &dir_cache;
+    int depth = 0;
+    while (*link) {
+        DirIndex *idx = *link;
+        if (idx->dev == sb.st_dev && idx->ino == sb.st_ino) {
+            *link = idx->next;
+            if (!idx->racy && idx->mtime.tv_sec == sb.st_mtim.tv_sec &&
+                idx->mtime.tv_nsec == sb.st_mtim.tv_nsec) {
+                /* Still fresh: move to the front of the cache. */
+                idx->next = dir_cache;
+                dir_cache = idx;
+                close(fd);
+                return idx;
             }
+            free_dir_index(idx);
+            continue;
+        }
+        /* Drop the least recently used indexes once the cache is full. */
+        if (++depth >= DIR_CACHE_MAX) {
+            *link = idx->next;
+            free_dir_index(idx);
+            continue;
         }
+        link = &idx->next;
     }
-    closedir(dir);
-    exit(EXIT_SUCCESS);
-}
 
-void pwd() {
-    char cwd[PT_MAX];
-    getcwd(cwd, sizeof(cwd));
-    printf("%s\n", cwd);
-    exit(EXIT_SUCCESS);
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    DirIndex *idx = build_dir_index(fd);
+    close(fd);
+    idx->dev = sb.st_dev;
+    idx->ino = sb.st_ino;
+    idx->mtime = sb.st_mtim;
+
+    /* Directory mtimes have coarse granularity, so an entry added right after
+     * the scan may not change the mtime. Don't trust a recently modified
+     * directory's index. */
+    idx->racy = (now.tv_sec - sb.st_mtim.tv_sec) < 2;
+
+    idx->next = dir_cache;
+    dir_cache = idx;
+    return idx;
 }
 
-void print_result(Process *head, char *input_cpy) {
-    Process *cur = head;
-    fprintf(stderr, "+ completed '%s' ", input_cpy);
-    while (cur) {
-        fprintf(stderr, "[%d]", cur->exit_val);
-        cur = cur->next;
+/* Finds the range [*lo, *hi) of names in idx starting with the first n bytes
+ * of prefix. */
+void prefix_range(const DirIndex *idx, const char *prefix, size_t n,
+                  size_t *lo, size_t *hi) {
+    size_t l = 0, h = idx->count;
+    while (l < h) {
+        size_t mid = (l + h) / 2;
+        if (strncmp(idx->names[mid], prefix, n) < 0)
+            l = mid + 1;
+        else
+            h = mid;
+    }
+    *lo = l;
+    h = idx->count;
+    while (l < h) {
+        size_t mid = (l + h) / 2;
+        if (strncmp(idx->names[mid], prefix, n) <= 0)
+            l = mid + 1;
+        else
+            h = mid;
     }
-    fprintf(stderr, "\n");
-    free(input_cpy);
+    *hi = l;
 }
 
-void run_processes(Process *head, char *input_cpy) {
-    Process *cur = head;
-    while (cur) {
-        char *cmd = cur->cmd;
-        /* Still in parent process... */
-        if (!strcmp(cmd, "exit")) {
-            fprintf(stderr, "Bye...\n");
-            print_result(head, input_cpy);
-            exit(EXIT_SUCCESS);
-        } else if (!strcmp(cmd, "cd")) {
-            char *dir_name = cur->args[1];
+/* Matches a bracket expression starting after the `[` at pat[*i]. Advances
+ * *i past the closing `]`. Returns -1 if the bracket is not terminated. */
+int match_bracket(const char *pat, size_t *i, char c) {
+    size_t p = *i;
+    bool negate = (pat[p] == '!' || pat[p] == '^');
+    bool matched = false;
+    if (negate) p++;
 
-            /* No need to call exit from here because we're still in the parent
-             * process. */
-            if (!dir_name || chdir(dir_name) == -1) {
-                handle_error(LAUNCH_ERR_ACCESS_DIR);
-                cur->exit_val = 1;
-            }
+    for (bool first = true; pat[p] && (first || pat[p] != ']'); first = false) {
+        char lo = pat[p++];
+        char hi = lo;
+        if (pat[p] == '-' && pat[p + 1] && pat[p + 1] != ']') {
+            hi = pat[p + 1];
+            p += 2;
         }
+        if (c >= lo && c <= hi) matched = true;
+    }
+    if (pat[p] != ']') return -1;
+    *i = p + 1;
+    return matched != negate;
+}
 
-        /* Forking */
-        else if (!(cur->pid = fork())) {
-            /* Here we need to call exit since we're in the child process. */
-            if (!setup_fd_table(cur, head)) {
-                handle_error(LAUNCH_ERR_ACCESS_FILE);
-                exit(EXIT_FAILURE);
+/* Matches name against one path component pattern supporting `*`, `?` and
+ * `[...]`. Quoted characters in the pattern only match themselves. Stops at
+ * the end of pat or at a `/`. */
+bool glob_match(const char *pat, const unsigned char *mask, const char *name) {
+    size_t p = 0, star_p = 0;
+    const char *star_name = NULL;
+
+    while (*name) {
+        bool active = (mask[p] == QUOTE_NONE);
+        if (active && pat[p] == '*') {
+            star_p = ++p;
+            star_name = name;
+            continue;
+        }
+        if (pat[p] && pat[p] != '/') {
+            size_t next = p + 1;
+            int ok;
+            if (active && pat[p] == '?') {
+                ok = 1;
+            } else if (active && pat[p] == '[') {
+                ok = match_bracket(pat, &next, *name);
+                if (ok == -1) {
+                    /* Unterminated bracket: treat `[` literally. */
+                    next = p + 1;
+                    ok = (*name == '[');
+                }
+            } else {
+                ok = (pat[p] == *name);
             }
-            if (!strcmp(cmd, "pwd")) {
-                pwd();
-            } else if (!strcmp(cmd, "sls")) {
-                sls();
+            if (ok) {
+                p = next;
+                name++;
+                continue;
             }
+        }
+        /* Mismatch: backtrack to the last `*`. */
+        if (!star_name) return false;
+        p = star_p;
+        name = ++star_name;
+    }
+
+    while (pat[p] == '*' && mask[p] == QUOTE_NONE) p++;
+    return pat[p] == '\0' || pat[p] == '/';
+}
+
+/* Returns the length of the literal prefix of a pattern component, used to
+ * narrow the range of sorted names that need matching. */
+size_t literal_prefix(const char *pat, const unsigned char *mask) {
+    size_t n = 0;
+    while (pat[n] && pat[n] != '/' &&
+           !(mask[n] == QUOTE_NONE && is_glob_char(pat[n])))
+        n++;
+    return n;
+}
+
+bool is_directory(const char *path) {
+    struct stat sb;
+    return stat(path, &sb) == 0 && S_ISDIR(sb.st_mode);
+}
+
+/* Expands the remaining pattern components in pat below the directory path
+ * (of length len) built so far in path. Appends matches to out. */
+void glob_dir(char *path, size_t len, const char *pat, const unsigned char *mask,
+              ArgVec *out) {
+    const char *slash = strchr(pat, '/');
+    size_t comp_len = slash ? (size_t)(slash - pat) : strlen(pat);
+    if (len + comp_len + 2 > PATH_MAX) return;
 
-            execvp(cmd, cur->args);
-            handle_error(LAUNCH_ERR_CMD_NOT_FOUND);
-            exit(EXIT_FAILURE);
+    if (!has_glob_chars(pat, mask, comp_len)) {
+        /* Literal component: no need to read the directory. */
+        memcpy(path + len, pat, comp_len);
+        size_t new_len = len + comp_len;
+        path[new_len] = '\0';
+        if (slash) {
+            path[new_len++] = '/';
+            path[new_len] = '\0';
+            glob_dir(path, new_len, slash + 1, mask + comp_len + 1, out);
+        } else if (access(path, F_OK) == 0) {
+            argvec_push(out, arena_strndup(&cmd_arena, path, new_len));
         }
-        cur = cur->next;
+        path[len] = '\0';
+        return;
     }
 
-    close_pipes(head);
+    DirIndex *idx = get_dir_index(len ? path : ".");
+    if (!idx) return;
 
-    cur = head;
-    int process_return;
+    /* Names are sorted, so only the range sharing the literal prefix can
+     * match. */
+    size_t prefix_len = literal_prefix(pat, mask);
+    size_t lo, hi;
+    prefix_range(idx, pat, prefix_len, &lo, &hi);
 
-    while (cur) {
-        /* Only run if cmd != exit and cmd != cd, since those don't fork. */
-        if (strcmp(cur->cmd, "exit") && strcmp(cur->cmd, "cd")) {
-            waitpid(cur->pid, &process_return, 0);
-            cur->exit_val = WEXITSTATUS(process_return);
+    for (size_t i = lo; i < hi; i++) {
+        const char *name = idx->names[i];
+
+        /* Hidden files only match patterns that start with a dot. */
+        if (name[0] == '.' && pat[0] != '.') continue;
+        if (!glob_match(pat, mask, name)) continue;
+
+        size_t name_len = strlen(name);
+        if (len + name_len + 2 > PATH_MAX) continue;
+        memcpy(path + len, name, name_len + 1);
+        if (!slash) {
+            argvec_push(out, arena_strndup(&cmd_arena, path, len + name_len));
+        } else if (dir_entry_type(name) == DT_DIR ||
+                   ((dir_entry_type(name) == DT_LNK ||
+                     dir_entry_type(name) == DT_UNKNOWN) &&
+                    is_directory(path))) {
+            path[len + name_len] = '/';
+            path[len + name_len + 1] = '\0';
+            glob_dir(path, len + name_len + 1, slash + 1, mask + comp_len + 1,
+                     out);
         }
-        cur = cur->next;
+        path[len] = '\0';
     }
+}
+
+/* Expands a pattern word into matching paths. Returns false (leaving out as
+ * is) if nothing matched. */
+bool glob_expand(const Word *w, ArgVec *out) {
+    char path[PATH_MAX];
+    size_t before = out->len;
+    size_t len = 0;
 
-    print_result(head, input_cpy);
+    while (w->text[len] == '/') {
+        path[len] = '/';
+        len++;
+    }
+    path[len] = '\0';
+    glob_dir(path, len, w->text + len, w->mask + len, out);
+    return out->len > before;
 }
 
-void free_processes(Process *head) {
-    Process *cur = head;
-    while (cur != NULL) {
-        Process *next = cur->next;
-        free(cur->token_copy);
-        free(cur);
-        cur = next;
+/* Forgets the command trie and hash. */
+void path_cache_flush() {
+    free(path_cache.nodes);
+    path_cache.nodes = NULL;
+    path_cache.num_nodes = path_cache.nodes_cap = 0;
+
+    for (size_t i = 0; i < path_cache.hash_cap; i++) {
+        free(path_cache.hash[i].name);
+        free(path_cache.hash[i].path);
     }
+    free(path_cache.hash);
+    path_cache.hash = NULL;
+    path_cache.hash_cap = path_cache.hash_used = 0;
+    path_cache.snapshot = false;
 }
 
-void prompt_get_input(char *input) {
-    char *nl;
-    /* Print prompt */
-    printf("sshell@ucd$ ");
-    fflush(stdout);
+/* Records the identity of every PATH directory before the cache is filled,
+ * so later changes to them can be noticed. */
+void path_cache_snapshot() {
+    if (path_cache.snapshot) return;
+    path_cache.snapshot = true;
 
-    /* Get command line */
-    fgets(input, CMDLINE_MAX, stdin);
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    for (size_t i = 0; i < path_cache.num_dirs; i++) {
+        PathDir *d = &path_cache.dirs[i];
+        struct stat sb;
+        if (stat(d->name, &sb) == -1) memset(&sb, 0, sizeof(sb));
+        d->dev = sb.st_dev;
+        d->ino = sb.st_ino;
+        d->mtime = sb.st_mtim;
 
-    /* Print command line if stdin is not provided by terminal */
-    if (!isatty(STDIN_FILENO)) {
-        printf("%s", input);
-        fflush(stdout);
+        /* Same mtime granularity problem as directory indexes. */
+        d->racy = sb.st_ino && (now.tv_sec - sb.st_mtim.tv_sec) < 2;
     }
-    /* Remove trailing newline from command line */
-    nl = strchr(input, '\n');
-    if (nl) *nl = '\0';
 }
 
-int main(void) {
-    char input[CMDLINE_MAX];
-    char *process_tokens[ARGS_MAX];
-    while (1) {
-        /* Prompt user for input and store result. */
-        prompt_get_input(input);
+/* Drops the cache if $PATH changed or one of its directories was modified
+ * since the cache was filled. Called once per command line, so this costs
+ * one stat per PATH directory, and nothing until the cache is used. */
+void path_cache_check() {
+    const char *env = getenv("PATH");
+    if (!env) env = "/bin:/usr/bin";
 
-        /* Check for parsing errors. */
-        ErrorType e = parse_errors(input);
-        if (e != NO_ERROR) {
-            handle_error(e);
-            continue;
+    if (!path_cache.path_env || strcmp(env, path_cache.path_env)) {
+        path_cache_flush();
+        for (size_t i = 0; i < path_cache.num_dirs; i++)
+            free(path_cache.dirs[i].name);
+        free(path_cache.dirs);
+        free(path_cache.path_env);
+        path_cache.path_env = strdup(env);
+
+        size_t count = 1;
+        for (const char *c = env; *c; c++) count += (*c == ':');
+        path_cache.dirs = (PathDir *)calloc(count, sizeof(PathDir));
+        path_cache.num_dirs = 0;
+        for (const char *start = env;; ) {
+            const char *end = strchrnul(start, ':');
+            /* An empty entry means the current directory. */
+            path_cache.dirs[path_cache.num_dirs++].name =
+                (end == start) ? strdup(".") : strndup(start, end - start);
+            if (!*end) break;
+            start = end + 1;
+        }
+        return;
+    }
+    if (!path_cache.snapshot) return;
+
+    for (size_t i = 0; i < path_cache.num_dirs; i++) {
+        PathDir *d = &path_cache.dirs[i];
+        struct stat sb;
+        if (stat(d->name, &sb) == -1) memset(&sb, 0, sizeof(sb));
+        if (d->racy || d->dev != sb.st_dev || d->ino != sb.st_ino ||
+            d->mtime.tv_sec != sb.st_mtim.tv_sec ||
+            d->mtime.tv_nsec != sb.st_mtim.tv_nsec) {
+            path_cache_flush();
+            return;
         }
-        /* Copy input to print out later, since tokenizing modifies input. */
-        char *input_cpy = strdup(input);
+    }
+}
 
-        /* Tokenize input and parse into Process linked list. */
-        tokenize_processes(input, process_tokens);
-        Process *head = initialize_processes(process_tokens);
-        /* Create pipes. */
-        Process *cur = head;
-        while (cur) {
-            if (cur->next) {
-                int fd[2];
-                pipe(fd);
-                cur->out = fd[1];
-                cur->next->in = fd[0];
-            }
-            cur = cur->next;
+int trie_new_node(unsigned char c) {
+    if (path_cache.num_nodes == path_cache.nodes_cap) {
+        path_cache.nodes_cap = path_cache.nodes_cap ? path_cache.nodes_cap * 2
+                                                    : 4096;
+        path_cache.nodes = (TrieNode *)realloc(
+            path_cache.nodes, path_cache.nodes_cap * sizeof(TrieNode));
+    }
+    TrieNode *n = &path_cache.nodes[path_cache.num_nodes];
+    n->c = c;
+    n->child = n->sibling = n->dir = -1;
+    return path_cache.num_nodes++;
+}
+
+/* Returns the child of node for character c, adding it if create is set.
+ * Returns -1 if there is no such child. */
+int trie_child(int node, unsigned char c, bool create) {
+    int prev = -1, cur = path_cache.nodes[node].child;
+    while (cur != -1 && path_cache.nodes[cur].c < c) {
+        prev = cur;
+        cur = path_cache.nodes[cur].sibling;
+    }
+    if (cur != -1 && path_cache.nodes[cur].c == c) return cur;
+    if (!create) return -1;
+
+    /* Adding a node may move the array: only hold on to indexes. */
+    int added = trie_new_node(c);
+    path_cache.nodes[added].sibling = cur;
+    if (prev == -1)
+        path_cache.nodes[node].child = added;
+    else
+        path_cache.nodes[prev].sibling = added;
+    return added;
+}
+
+/* Adds a name to the trie. Earlier PATH directories win, as in a PATH
+ * search. */
+void trie_insert(const char *name, int dir) {
+    int node = 0;
+    for (; *name; name++) node = trie_child(node, (unsigned char)*name, true);
+    if (path_cache.nodes[node].dir == -1) path_cache.nodes[node].dir = dir;
+}
+
+/* Returns the trie node reached by the first len characters of name, or -1
+ * if no executable starts with them. */
+int trie_find(const char *name, size_t len) {
+    int node = 0;
+    for (size_t i = 0; i < len && node != -1; i++)
+        node = trie_child(node, (unsigned char)name[i], false);
+    return node;
+}
+
+/* Builds the trie of builtins and PATH executables on first use. Directory
+ * listings come from the directory index cache. */
+void path_trie_build() {
+    if (path_cache.num_nodes) return;
+    path_cache_snapshot();
+    trie_new_node('\0');
+
+    for (int i = 0; builtins[i]; i++) trie_insert(builtins[i], -2);
+    for (size_t i = 0; i < path_cache.num_dirs; i++) {
+        DirIndex *idx = get_dir_index(path_cache.dirs[i].name);
+        if (!idx) continue;
+        for (size_t j = 0; j < idx->count; j++) {
+            if (dir_entry_type(idx->names[j]) != DT_DIR)
+                trie_insert(idx->names[j], i);
         }
-        run_processes(head, input_cpy);
-        free_processes(head);
     }
+}
 
-    return EXIT_SUCCESS;
-}
\ No newline at end of file
+bool is_builtin(const char *name) {
+    for (int i = 0; builtins[i]; i++) {
+        if (!strcmp(name, builtins[i])) return true;
+    }
+    return false;
+}
+
+/* FNV-1a hash of a command name. */
+size_t hash_name(const char *name) {
+    size_t h = 14695981039346656037ULL;
+    for (; *name; name++) h = (h ^ (unsigned char)*name) * 1099511628211ULL;
+    return h;
+}
+
+/* Returns the command hash slot holding name, or the empty slot where it
+ * would go. */
+CommandEntry *command_slot(const char *name) {
+    size_t mask = path_cache.hash_cap - 1;
+    size_t i = hash_name(name) & mask;
+    while (path_cache.hash[i].name && strcmp(path_cache.hash[i].name, name))
+        i = (i + 1) & mask;
+    return &path_cache.hash[i];
+}
+
+/* Returns true if path is an executable file. */
+bool is_executable(const char *path) {
+    struct stat sb;
+    return access(path, X_OK) == 0 && stat(path, &sb) == 0 &&
+           S_ISREG(sb.st_mode);
+}
+
+/* Resolves a command name to the file PATH search would run, remembering
+ * the answer in the command hash. Uses the trie instead of probing every
+ * directory once completion has built it. Returns NULL for names containing
+ * a slash or not found, leaving those to execvp. */
+const char *find_command(const char *name) {
+    if (!*name || strchr(name, '/')) return NULL;
+    if (path_cache.hash_cap) {
+        CommandEntry *e = command_slot(name);
+        if (e->name) return e->path;
+    }
+
+    if (!path_cache.path_env) path_cache_check();
+    path_cache_snapshot();
+    char path[PATH_MAX];
+    int found = -1;
+    if (path_cache.num_nodes) {
+        int node = trie_find(name, strlen(name));
+        int dir = (node == -1) ? -1 : path_cache.nodes[node].dir;
+        if (dir >= 0) {
+            snprintf(path, sizeof(path), "%s/%s", path_cache.dirs[dir].name,
+                     name);
+            if (is_executable(path)) found = dir;
+        }
+    }
+    for (size_t i = 0; found == -1 && i < path_cache.num_dirs; i++) {
+        snprintf(path, sizeof(path), "%s/%s", path_cache.dirs[i].name, name);
+        if (is_executable(path)) found = i;
+    }
+
+    /* Relative directories depend on the working directory: don't cache
+     * what was found in them. */
+    if (found == -1) return NULL;
+    if (path_cache.dirs[found].name[0] != '/')
+        return arena_strndup(&cmd_arena, path, strlen(path));
+
+    if ((path_cache.hash_used + 1) * 2 > path_cache.hash_cap) {
+        CommandEntry *old = path_cache.hash;
+        size_t old_cap = path_cache.hash_cap;
+        path_cache.hash_cap = old_cap ? old_cap * 2 : 64;
+        path_cache.hash =
+            (CommandEntry *)calloc(path_cache.hash_cap, sizeof(CommandEntry));
+        for (size_t i = 0; i < old_cap; i++) {
+            if (old[i].name) *command_slot(old[i].name) = old[i];
+        }
+        free(old);
+    }
+    CommandEntry *e = command_slot(name);
+    e->name = strdup(name);
+    e->path = strdup(path);
+    path_cache.hash_used++;
+    return e->path;
+}
+
+char *process_substitution(const Word *w, Process *p);
+
+/* Globs one field of an expanded word, or adds it as is. */
+void expand_field(const Word *w, ArgVec *out) {
+    if (has_glob_chars(w->text, w->mask, (size_t)-1) && glob_expand(w, out))
+        return;
+    argvec_push(out, w->text);
+}
+
+/* Expands one word, appending the resulting arguments to out. Returns false
+ * if the word could not be expanded. */
+bool expand_word(const Word *word, Process *p, ArgVec *out) {
+    if (word->kind != WORD_PLAIN) {
+        char *path = process_substitution(word, p);
+        if (!path) return false;
+        argvec_push(out, path);
+        return true;
+    }
+
+    Word w;
+    if (!expand_vars(word, &w)) return true;
+
+    /* Split at whitespace that came from unquoted command substitutions.
+     * Empty fields are dropped. The expanded text is ours to modify. */
+    Word field = w;
+    size_t len = 0;
+    for (size_t i = 0;; i++) {
+        bool end = (w.text[i] == '\0');
+        if (!end && !(w.mask[i] & FIELD_SPLIT)) {
+            len++;
+            continue;
+        }
+        if (len || (end && field.text == w.text && w.quoted)) {
+            w.text[i] = '\0';
+            expand_field(&field, out);
+        }
+        if (end) break;
+        field.text = w.text + i + 1;
+        field.mask = w.mask + i + 1;
+        len = 0;
+    }
+    return true;
+}
+
+/* Runs variable, glob and process substitution expansion over process
+ * arguments and output file, producing the argv used to launch the process.
+ * Returns false if an expansion failed. */
+bool expand_process(Process *p) {
+    ArgVec out = {NULL, 0, 0};
+    for (int i = 0; p->args[i].text; i++) {
+        if (!expand_word(&p->args[i], p, &out)) return false;
+    }
+
+    if (!out.items) {
+        out.items = (char **)arena_alloc(&cmd_arena, sizeof(char *));
+        out.items[0] = NULL;
+    }
+    p->argv = out.items;
+    p->cmd = p->argv[0];
+
+    /* The output file must expand to a single path. A pattern is only used
+     * if it matches exactly one file. */
+    if (p->redirect_output != NO_REDIRECT) {
+        ArgVec files = {NULL, 0, 0};
+        if (!expand_word(&p->filename, p, &files)) return false;
+        p->output_path = (files.len == 1) ? files.items[0] : "";
+        if (files.len > 1 && p->filename.kind == WORD_PLAIN) {
+            Word w;
+            expand_vars(&p->filename, &w);
+            p->output_path = w.text;
+        }
+    }
+    return true;
+}
+
+/* Creates a sealed, rewound memfd holding data, to be dup'ed as a process's
+ * stdin. The shell writes the whole payload itself since a memfd never
+ * blocks, so no writer process is needed. Returns -1 on failure. */
+int make_here_fd(const char *data, size_t len) {
+    int fd = memfd_create("sshell-here", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd == -1) return -1;
+
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            close(fd);
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+
+    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+    lseek(fd, 0, SEEK_SET);
+    return fd;
+}
+
+/* Expands a process's here-string or here-document into its here_fd.
+ * Returns false if the memfd could not be created. */
+bool open_here_input(Process *p) {
+    Word payload;
+    if (p->here_type == HERE_STRING) {
+        if (!expand_vars(&p->here_word, &payload)) payload.text = "";
+        size_t len = strlen(payload.text);
+
+        /* A here-string always ends with a newline. */
+        char *text = (char *)arena_alloc(&cmd_arena, len + 1);
+        memcpy(text, payload.text, len);
+        text[len] = '\n';
+        p->here_fd = make_here_fd(text, len + 1);
+    } else {
+        /* Documents inside a substitution have no body to read. */
+        if (!p->here_body.text || !expand_vars(&p->here_body, &payload))
+            payload.text = "";
+        p->here_fd = make_here_fd(payload.text, strlen(payload.text));
+    }
+    return p->here_fd != -1;
+}
+
+/* Reads the body of every here-document in the list from stdin, one line at
+ * a time until a line matching the delimiter. Variables in the body are
+ * expanded at launch unless the delimiter was quoted. */
+void read_here_documents(Pipeline *list) {
+    char *line = NULL;
+    size_t line_cap = 0;
+
+    for (Pipeline *pl = list; pl; pl = pl->next) {
+        for (Process *p = pl->head; p; p = p->next) {
+            if (p->here_type != HERE_DOCUMENT) continue;
+
+            const char *delim = p->here_word.text;
+            unsigned char flag =
+                p->here_word.quoted ? QUOTE_SINGLE : QUOTE_DOUBLE;
+            WordBuf b = {NULL, NULL, 0, 0};
+            word_buf_append(&b, "", 0, flag);
+
+            while (1) {
+                printf("> ");
+                fflush(stdout);
+                ssize_t n = getline(&line, &line_cap, stdin);
+                if (n == -1) {
+                    /* EOF ends the document, like the delimiter would. */
+                    printf("\n");
+                    break;
+                }
+                if (!isatty(STDIN_FILENO)) {
+                    printf("%s", line);
+                    fflush(stdout);
+                }
+                bool has_newline = (line[n - 1] == '\n');
+                if (has_newline) line[n - 1] = '\0';
+                if (!strcmp(line, delim)) break;
+                if (has_newline) line[n - 1] = '\n';
+                word_buf_append(&b, line, n, flag);
+            }
+
+            p->here_body.text = b.text;
+            p->here_body.mask = b.mask;
+            p->here_body.quoted = true;
+        }
+    }
+    free(line);
+}
+
+/* Sets or clears the option named by `set -o NAME` or `set +o NAME`, where
+ * the timeout is set with `set -o timeout=SECONDS`. Returns false for
+ * anything else. */
+bool set_option(char **argv) {
+    bool on = !strcmp(argv[1], "-o");
+    if ((!on && strcmp(argv[1], "+o")) || !argv[2] || argv[3]) return false;
+
+    char *name = argv[2];
+    if (!strcmp(name, "pipefail")) {
+        options.pipefail = on;
+    } else if (!strcmp(name, "failfast")) {
+        options.failfast = on;
+    } else if (!strcmp(name, "threads")) {
+        options.threads = on;
+    } else if (!strcmp(name, "splice")) {
+        options.splice = on;
+    } else if (!on && !strcmp(name, "timeout")) {
+        options.timeout = 0;
+    } else if (on && !strncmp(name, "timeout=", 8) && isdigit(name[8])) {
+        char *end;
+        unsigned long secs = strtoul(name + 8, &end, 10);
+        if (*end || secs > UINT_MAX / 1000) return false;
+        options.timeout = secs;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/* Sets up co to run fn on a fresh stack with a guard page below it. */
+bool co_init(Coroutine *co, void (*fn)(void)) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    co->stack = mmap(NULL, COROUTINE_STACK_SIZE + page, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (co->stack == MAP_FAILED) return false;
+    mprotect(co->stack, page, PROT_NONE);
+
+    getcontext(&co->ctx);
+    co->ctx.uc_stack.ss_sp = co->stack + page;
+    co->ctx.uc_stack.ss_size = COROUTINE_STACK_SIZE;
+    co->ctx.uc_link = &co->caller;
+    makecontext(&co->ctx, fn, 0);
+    co->done = false;
+    return true;
+}
+
+void co_free(Coroutine *co) {
+    munmap(co->stack, COROUTINE_STACK_SIZE + sysconf(_SC_PAGESIZE));
+}
+
+/* Runs co until it yields or its entry point returns. */
+void co_resume(Coroutine *co) { swapcontext(&co->caller, &co->ctx); }
+
+void co_yield(Coroutine *co) { swapcontext(&co->ctx, &co->caller); }
+
+/* Yields until fd is ready for events. Returns false if the builtin was
+ * stopped meanwhile. */
+bool io_wait(BuiltinIO *io, int fd, short events) {
+    /* On a worker thread, just block until fd or the cancel wakeup. */
+    if (io->threaded) {
+        struct pollfd fds[2] = {{fd, events, 0}, {io->wake_fd, POLLIN, 0}};
+        while (poll(fds, 2, -1) == -1 && errno == EINTR)
+            ;
+        return !__atomic_load_n(&io->cancel, __ATOMIC_ACQUIRE);
+    }
+
+    io->wait_fd = fd;
+    io->wait_events = events;
+    co_yield(&io->co);
+    return !io->cancel;
+}
+
+/* Reads up to n bytes from fd, yielding while none are available. Returns
+ * the count, 0 at end of file, or -1 on an error or once stopped. */
+ssize_t io_read_fd(BuiltinIO *io, int fd, bool nonblock, char *buf,
+                   size_t n) {
+    if (!nonblock && !io_wait(io, fd, POLLIN)) return -1;
+    while (!io->cancel) {
+        ssize_t r = read(fd, buf, n);
+        if (r >= 0) return r;
+        if (errno == EINTR) continue;
+        if (errno != EAGAIN || !io_wait(io, fd, POLLIN)) return -1;
+    }
+    return -1;
+}
+
+ssize_t io_read(BuiltinIO *io, char *buf, size_t n) {
+    return io_read_fd(io, io->in, io->in_nonblock, buf, n);
+}
+
+/* Writes all of buf to fd, yielding while it is full. A blocking fd is
+ * written PIPE_BUF bytes at a time, which a writable pipe always takes. */
+bool io_write_fd(BuiltinIO *io, int fd, bool nonblock, const char *buf,
+                 size_t n) {
+    while (n) {
+        if (io->cancel) return false;
+        if (!nonblock && !io_wait(io, fd, POLLOUT)) return false;
+        ssize_t w = write(fd, buf, (nonblock || n < PIPE_BUF) ? n : PIPE_BUF);
+        if (w == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN && io_wait(io, fd, POLLOUT)) continue;
+            if (errno == EPIPE) io->broken_pipe = true;
+            return false;
+        }
+        buf += w;
+        n -= w;
+    }
+    return true;
+}
+
+/* Maps a fresh output buffer. It has pages of its own so that vmsplice()
+ * can hand them to a pipe. */
+char *io_buffer() {
+    char *buf = mmap(NULL, BUILTIN_BUF_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    return (buf == MAP_FAILED) ? NULL : buf;
+}
+
+/* Moves the first n bytes of the buffer into the output pipe with
+ * vmsplice(), which maps the pages into it rather than copying them. The
+ * pipe reads those pages until the reader has drained it, so the next flush
+ * fills the spare buffer instead. */
+bool io_splice(BuiltinIO *io, size_t n) {
+    if (!io->spare) io->spare = io_buffer();
+    if (!io->spare)
+        return io_write_fd(io, io->out, io->out_nonblock, io->buf, n);
+
+    struct iovec iov = {io->buf, n};
+    bool ok = true;
+    while (iov.iov_len) {
+        if (io->cancel) {
+            ok = false;
+            break;
+        }
+        ssize_t w = vmsplice(io->out, &iov, 1, SPLICE_F_NONBLOCK);
+        if (w == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN && io_wait(io, io->out, POLLOUT)) continue;
+            if (errno == EPIPE) io->broken_pipe = true;
+            ok = false;
+            break;
+        }
+        iov.iov_base = (char *)iov.iov_base + w;
+        iov.iov_len -= w;
+    }
+
+    /* A default pipe holds no more than one buffer, so once this one is in
+     * the spare's pages have been read. A bigger pipe may still hold some
+     * of them: those stay with the pipe and the spare gets fresh pages. */
+    int queued;
+    if (ioctl(io->out, FIONREAD, &queued) == -1 || (size_t)queued > n) {
+        char *fresh = io_buffer();
+        if (!fresh) return false;
+        munmap(io->spare, BUILTIN_BUF_SIZE);
+        io->spare = fresh;
+    }
+    char *next = io->spare;
+    io->spare = io->buf;
+    io->buf = next;
+    return ok;
+}
+
+bool io_flush(BuiltinIO *io) {
+    size_t len = io->len;
+    io->len = 0;
+    if (io->out_splice) return io_splice(io, len);
+    return io_write_fd(io, io->out, io->out_nonblock, io->buf, len);
+}
+
+/* Writes to the builtin's stdout through its buffer. */
+bool io_write(BuiltinIO *io, const char *buf, size_t n) {
+    if (io->len + n > BUILTIN_BUF_SIZE && !io_flush(io)) return false;
+    if (n >= BUILTIN_BUF_SIZE)
+        return io_write_fd(io, io->out, io->out_nonblock, buf, n);
+    memcpy(io->buf + io->len, buf, n);
+    io->len += n;
+    return true;
+}
+
+bool io_printf(BuiltinIO *io, const char *fmt, ...) {
+    char line[PT_MAX + 64];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    if (n >= (int)sizeof(line)) n = sizeof(line) - 1;
+    return io_write(io, line, n);
+}
+
+/* A reentrant getopt() for builtins, which may run on several threads at
+ * once. Returns the next option in argv, '?' for one that isn't in opts or
+ * lacks its argument, or -1 at the first operand or after "--". */
+int builtin_getopt(OptState *st, int argc, char **argv, const char *opts) {
+    if (!st->pos) {
+        char *word = (st->ind < argc) ? argv[st->ind] : NULL;
+        if (!word || word[0] != '-' || !word[1]) return -1;
+        if (!strcmp(word, "--")) {
+            st->ind++;
+            return -1;
+        }
+        st->pos = 1;
+    }
+
+    char *word = argv[st->ind];
+    int c = (unsigned char)word[st->pos++];
+    const char *spec = (c == ':') ? NULL : strchr(opts, c);
+    bool last = !word[st->pos];
+    if (spec && spec[1] == ':') {
+        if (!last)
+            st->arg = word + st->pos;
+        else if (st->ind + 1 < argc)
+            st->arg = argv[++st->ind];
+        else
+            c = '?';
+        last = true;
+    }
+    if (last) {
+        st->ind++;
+        st->pos = 0;
+    }
+    return spec ? c : '?';
+}
+
+/* Opens a file named by a builtin's argument, printing why if it can't. */
+int builtin_open(const char *cmd, const char *path, int flags) {
+    int fd = open(path, flags | O_NONBLOCK | O_CLOEXEC, 0644);
+    if (fd == -1) fprintf(stderr, "%s: %s: %s\n", cmd, path, strerror(errno));
+    return fd;
+}
+
+/* Implements the builtin sls command. */
+int builtin_sls(BuiltinIO *io, int argc, char **argv) {
+    (void)argc;
+    (void)argv;
+    DIR *dir;
+    struct dirent *dp;
+    struct stat sb;
+    dir = opendir(".");
+    if (dir == NULL) {
+        handle_error(LAUNCH_ERR_ACCESS_DIR);
+        return EXIT_FAILURE;
+    }
+    while ((dp = readdir(dir)) != NULL) {
+        if (dp->d_name[0] != '.')  // Exclude hidden files
+        {
+            if (fstatat(dirfd(dir), dp->d_name, &sb, 0) == 0 &&
+                !io_printf(io, "%s (%lld bytes)\n", dp->d_name,
+                           (long long)sb.st_size))
+                break;
+        }
+    }
+    closedir(dir);
+    return EXIT_SUCCESS;
+}
+
+int builtin_pwd(BuiltinIO *io, int argc, char **argv) {
+    (void)argc;
+    (void)argv;
+    char cwd[PT_MAX];
+    if (!getcwd(cwd, sizeof(cwd))) return EXIT_FAILURE;
+    io_printf(io, "%s\n", cwd);
+    return EXIT_SUCCESS;
+}
+
+/* Prints the reaping counters. */
+int builtin_stats(BuiltinIO *io, int argc, char **argv) {
+    (void)argc;
+    (void)argv;
+    io_printf(io, "pipelines   %lu\n", stats.pipelines);
+    io_printf(io, "stages      %lu\n", stats.stages);
+    io_printf(io, "failed      %lu\n", stats.failed);
+    io_printf(io, "signaled    %lu\n", stats.signaled);
+    io_printf(io, "core dumps  %lu\n", stats.core_dumps);
+    io_printf(io, "cancelled   %lu\n", stats.cancelled);
+    io_printf(io, "timed out   %lu\n", stats.timed_out);
+    for (int sig = 1; sig < NSIG; sig++) {
+        if (!stats.by_signal[sig]) continue;
+        const char *name = sigabbrev_np(sig);
+        if (name)
+            io_printf(io, "SIG%-8s %lu\n", name, stats.by_signal[sig]);
+        else
+            io_printf(io, "signal %-4d %lu\n", sig, stats.by_signal[sig]);
+    }
+    return EXIT_SUCCESS;
+}
+
+/* Lists the options for a bare `set`. With arguments set runs on the shell
+ * itself, through set_option(). */
+int builtin_set(BuiltinIO *io, int argc, char **argv) {
+    (void)argc;
+    (void)argv;
+    io_printf(io, "pipefail  %s\n", options.pipefail ? "on" : "off");
+    io_printf(io, "failfast  %s\n", options.failfast ? "on" : "off");
+    io_printf(io, "threads   %s\n", options.threads ? "on" : "off");
+    io_printf(io, "splice    %s\n", options.splice ? "on" : "off");
+    if (options.timeout)
+        io_printf(io, "timeout   %us\n", options.timeout);
+    else
+        io_printf(io, "timeout   off\n");
+    return EXIT_SUCCESS;
+}
+
+/* Line, word and byte counts of one input. */
+typedef struct wc_counts {
+    unsigned long long lines, words, bytes;
+} WcCounts;
+
+bool wc_count(BuiltinIO *io, int fd, bool nonblock, WcCounts *c) {
+    char buf[4096];
+    bool in_word = false;
+    ssize_t n;
+    while ((n = io_read_fd(io, fd, nonblock, buf, sizeof(buf))) > 0) {
+        c->bytes += n;
+        for (ssize_t i = 0; i < n; i++) {
+            unsigned char ch = buf[i];
+            if (ch == '\n') c->lines++;
+            bool space = isspace(ch);
+            if (!space && !in_word) c->words++;
+            in_word = !space;
+        }
+    }
+    return n == 0;
+}
+
+/* Prints the counts selected by flags, in wc's fixed order. Columns are
+ * padded unless there is just one count of one input. */
+bool wc_print(BuiltinIO *io, const char *flags, int width, WcCounts *c,
+              const char *name) {
+    const char *keys = "lwc";
+    unsigned long long counts[] = {c->lines, c->words, c->bytes};
+    /* Room for three 20-digit counts, so snprintf() never truncates. */
+    char line[96];
+    size_t len = 0;
+    for (int i = 0; i < 3; i++) {
+        if (strchr(flags, keys[i]))
+            len += snprintf(line + len, sizeof(line) - len, " %*llu", width,
+                            counts[i]);
+    }
+
+    /* The name is written on its own so long paths aren't cut off. */
+    if (!io_write(io, line + 1, len - 1)) return false;
+    if (name && (!io_write(io, " ", 1) || !io_write(io, name, strlen(name))))
+        return false;
+    return io_write(io, "\n", 1);
+}
+
+/* wc [-clw] [FILE...] */
+int builtin_wc(BuiltinIO *io, int argc, char **argv) {
+    char flags[4] = "";
+    size_t num_flags = 0;
+    int opt;
+    while ((opt = builtin_getopt(&io->opt, argc, argv, "clw")) != -1) {
+        if (!strchr(flags, opt)) flags[num_flags++] = opt;
+    }
+    if (!flags[0]) strcpy(flags, "lwc");
+    int width = (strlen(flags) == 1 && argc - io->opt.ind <= 1) ? 1 : 7;
+
+    if (io->opt.ind == argc) {
+        WcCounts c = {0, 0, 0};
+        if (!wc_count(io, io->in, io->in_nonblock, &c)) return EXIT_FAILURE;
+        wc_print(io, flags, width, &c, NULL);
+        return EXIT_SUCCESS;
+    }
+
+    int status = EXIT_SUCCESS;
+    WcCounts total = {0, 0, 0};
+    for (int i = io->opt.ind; i < argc; i++) {
+        WcCounts c = {0, 0, 0};
+        int fd = builtin_open("wc", argv[i], O_RDONLY);
+        if (fd == -1) {
+            status = EXIT_FAILURE;
+            continue;
+        }
+        bool ok = wc_count(io, fd, true, &c);
+        close(fd);
+        if (!ok || !wc_print(io, flags, width, &c, argv[i]))
+            return EXIT_FAILURE;
+        total.lines += c.lines;
+        total.words += c.words;
+        total.bytes += c.bytes;
+    }
+    if (argc - io->opt.ind > 1) wc_print(io, flags, width, &total, "total");
+    return status;
+}
+
+/* Copies the first lines lines of fd to stdout. */
+bool head_copy(BuiltinIO *io, int fd, bool nonblock, long lines) {
+    char buf[4096];
+    while (lines > 0) {
+        ssize_t n = io_read_fd(io, fd, nonblock, buf, sizeof(buf));
+        if (n <= 0) return n == 0;
+
+        ssize_t end = 0;
+        while (end < n && lines > 0) {
+            char *nl = memchr(buf + end, '\n', n - end);
+            end = nl ? nl - buf + 1 : n;
+            if (nl) lines--;
+        }
+        if (!io_write(io, buf, end)) return false;
+    }
+    return true;
+}
+
+/* head [-n LINES] [FILE...] */
+int builtin_head(BuiltinIO *io, int argc, char **argv) {
+    long lines = 10;
+    int opt;
+    while ((opt = builtin_getopt(&io->opt, argc, argv, "n:")) != -1) {
+        char *end;
+        lines = strtol(io->opt.arg, &end, 10);
+        if (*end || lines < 0) {
+            fprintf(stderr, "head: invalid number of lines: '%s'\n",
+                    io->opt.arg);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (io->opt.ind == argc)
+        return head_copy(io, io->in, io->in_nonblock, lines) ? EXIT_SUCCESS
+                                                              : EXIT_FAILURE;
+
+    int status = EXIT_SUCCESS;
+    for (int i = io->opt.ind; i < argc; i++) {
+        int fd = builtin_open("head", argv[i], O_RDONLY);
+        if (fd == -1) {
+            status = EXIT_FAILURE;
+            continue;
+        }
+        bool ok = argc - io->opt.ind == 1 ||
+                  io_printf(io, "%s==> %s <==\n", i > io->opt.ind ? "\n" : "",
+                            argv[i]);
+        ok = ok && head_copy(io, fd, true, lines);
+        close(fd);
+        if (!ok) return EXIT_FAILURE;
+    }
+    return status;
+}
+
+/* tee [-a] [FILE...] */
+int builtin_tee(BuiltinIO *io, int argc, char **argv) {
+    int flags = O_WRONLY | O_CREAT | O_TRUNC;
+    int opt;
+    while ((opt = builtin_getopt(&io->opt, argc, argv, "a")) != -1)
+        flags = O_WRONLY | O_CREAT | O_APPEND;
+
+    /* A glob can name any number of files. */
+    int *fds = malloc(argc * sizeof(int)), num_fds = 0;
+    const char **names = malloc(argc * sizeof(char *));
+    if (!fds || !names) {
+        fprintf(stderr, "tee: %s\n", strerror(errno));
+        free(fds);
+        free(names);
+        return EXIT_FAILURE;
+    }
+    int status = EXIT_SUCCESS;
+    for (int i = io->opt.ind; i < argc; i++) {
+        int fd = builtin_open("tee", argv[i], flags);
+        if (fd == -1) {
+            status = EXIT_FAILURE;
+            continue;
+        }
+        names[num_fds] = argv[i];
+        fds[num_fds++] = fd;
+    }
+
+    char buf[4096];
+    ssize_t n;
+    while ((n = io_read(io, buf, sizeof(buf))) > 0) {
+        if (!io_write_fd(io, io->out, io->out_nonblock, buf, n)) break;
+        for (int i = 0; i < num_fds; i++) {
+            if (fds[i] != -1 && !io_write_fd(io, fds[i], true, buf, n)) {
+                fprintf(stderr, "tee: %s: %s\n", names[i], strerror(errno));
+                close(fds[i]);
+                fds[i] = -1;
+                status = EXIT_FAILURE;
+            }
+        }
+    }
+    for (int i = 0; i < num_fds; i++) {
+        if (fds[i] != -1) close(fds[i]);
+    }
+    free(fds);
+    free(names);
+    return (n == 0) ? status : EXIT_FAILURE;
+}
+
+/* Parses a nonzero size in bytes with an optional K, M or G suffix. */
+bool parse_size(const char *s, unsigned long *size) {
+    if (!isdigit((unsigned char)*s)) return false;
+    char *end;
+    unsigned long n = strtoul(s, &end, 10);
+    int shift = 0;
+    if (*end == 'k' || *end == 'K')
+        shift = 10;
+    else if (*end == 'm' || *end == 'M')
+        shift = 20;
+    else if (*end == 'g' || *end == 'G')
+        shift = 30;
+    if (shift) end++;
+    if (*end || !n || n > (ULONG_MAX >> shift)) return false;
+    *size = n << shift;
+    return true;
+}
+
+/* Parses the arguments of pipe-split, or of pmap, which always keeps order
+ * and takes a file before the command. Returns false on a bad option or if
+ * no command follows. */
+bool split_args(int argc, char **argv, SplitOptions *o) {
+    bool pmap = !strcmp(argv[0], "pmap");
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    *o = (SplitOptions){cpus > 0 ? cpus : 1, SPLIT_BLOCK_SIZE, pmap, false,
+                        NULL, NULL};
+    if (o->jobs > SPLIT_WORKERS_MAX) o->jobs = SPLIT_WORKERS_MAX;
+
+    OptState st = {1, 0, NULL};
+    int opt;
+    while ((opt = builtin_getopt(&st, argc, argv, pmap ? "j:" : "b:j:kr")) !=
+           -1) {
+        char *end;
+        if (opt == 'b') {
+            unsigned long n;
+            if (!parse_size(st.arg, &n) || n > SPLIT_BLOCK_MAX) return false;
+            o->block = n;
+        } else if (opt == 'j') {
+            long n = strtol(st.arg, &end, 10);
+            if (*end || n < 1 || n > SPLIT_WORKERS_MAX) return false;
+            o->jobs = n;
+        } else if (opt == 'k') {
+            o->keep_order = true;
+        } else if (opt == 'r') {
+            o->round_robin = true;
+        } else {
+            return false;
+        }
+    }
+
+    if (pmap) {
+        if (st.ind >= argc) return false;
+        o->path = argv[st.ind++];
+        if (st.ind < argc && !strcmp(argv[st.ind], "--")) st.ind++;
+    }
+    o->cmd = argv + st.ind;
+    return st.ind < argc;
+}
+
+/* Changes what the splitter's epoll set waits for on fd, 0 for nothing. */
+bool split_watch(Splitter *s, int fd, uint32_t *cur, uint32_t want,
+                 uint64_t tag) {
+    if (want == *cur) return true;
+    struct epoll_event ev = {.events = want, .data.u64 = tag};
+    int op = !*cur ? EPOLL_CTL_ADD : want ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
+    if (epoll_ctl(s->epoll, op, fd, &ev) == -1) return false;
+    *cur = want;
+    return true;
+}
+
+/* Stops waiting on *fd and closes it. A forked job may briefly share it, so
+ * closing alone wouldn't take it out of the epoll set. */
+void split_close_fd(Splitter *s, int *fd) {
+    if (*fd == -1) return;
+    epoll_ctl(s->epoll, EPOLL_CTL_DEL, *fd, NULL);
+    close(*fd);
+    *fd = -1;
+}
+
+/* Finds the next block in the pending input: the lines that fit in the
+ * block size, a longer line whole, or at end of file whatever is left. A
+ * mapped file's blocks run on to the end of the line instead, so its size
+ * divided by the number of jobs makes no more blocks than that. */
+void split_cut(Splitter *s) {
+    size_t n = s->pending_len, block = s->opt.block;
+    s->cut = 0;
+    if (n >= block) {
+        char *nl = s->map ? NULL : memrchr(s->pending, '\n', block);
+        if (!nl) nl = memchr(s->pending + block - 1, '\n', n - block + 1);
+        if (nl) {
+            s->cut = nl - s->pending + 1;
+            return;
+        }
+    }
+    if (s->eof) s->cut = n;
+}
+
+/* Reads more input after what is pending, growing the buffer for a line
+ * that doesn't fit. A read error ends the input. */
+void split_read(BuiltinIO *io, Splitter *s) {
+    if (s->pending_len == s->pending_cap) {
+        s->pending_cap *= 2;
+        s->pending = realloc(s->pending, s->pending_cap);
+    }
+    ssize_t n = read(io->in, s->pending + s->pending_len,
+                     s->pending_cap - s->pending_len);
+    if (n == -1 && (errno == EAGAIN || errno == EINTR)) return;
+    if (n > 0) {
+        s->pending_len += n;
+    } else {
+        if (n == -1) s->status = EXIT_FAILURE;
+        s->eof = true;
+    }
+    split_cut(s);
+}
+
+/* Starts a job for a block in the free slot w, with -k. */
+bool split_launch(Splitter *s, SplitWorker *w) {
+    int to[2], from[2];
+    if (pipe2(to, O_CLOEXEC) == -1) return false;
+    if (pipe2(from, O_CLOEXEC) == -1) {
+        close(to[0]);
+        close(to[1]);
+        return false;
+    }
+
+    s->job->in = to[0];
+    s->job->out = from[1];
+    pid_t pid = fork();
+    if (!pid) exec_stage(s->job, s->job);
+    close(to[0]);
+    close(from[1]);
+    if (pid == -1) {
+        close(to[1]);
+        close(from[0]);
+        return false;
+    }
+
+    fcntl(to[1], F_SETFL, O_NONBLOCK);
+    fcntl(from[0], F_SETFL, O_NONBLOCK);
+    int i = w - s->workers;
+    uint32_t events = 0;
+    w->feed = to[1];
+    w->drain = from[0];
+    split_watch(s, w->drain, &events, EPOLLIN, i * 4 + SPLIT_DRAIN);
+    w->pid = pid;
+    w->pidfd = syscall(SYS_pidfd_open, pid, 0);
+    events = 0;
+    if (w->pidfd != -1)
+        split_watch(s, w->pidfd, &events, EPOLLIN, i * 4 + SPLIT_PIDFD);
+    w->active = true;
+    w->seq = s->next_seq++;
+    return true;
+}
+
+/* Picks the worker for the next block: with -k any free slot, with -r the
+ * next worker in turn once it is free, otherwise of the free workers the
+ * one with the least input still unread. NULL if it has to wait. */
+SplitWorker *split_target(Splitter *s) {
+    SplitWorker *best = NULL;
+    int best_queued = INT_MAX;
+    for (int n = 0; n < s->num_workers; n++) {
+        int i = (s->next + n) % s->num_workers;
+        SplitWorker *w = &s->workers[i];
+        if (s->opt.keep_order) {
+            if (!w->active) return w;
+            continue;
+        }
+        if (w->feed == -1) continue;
+        if (s->opt.round_robin) {
+            if (w->block) return NULL;
+            s->next = (i + 1) % s->num_workers;
+            return w;
+        }
+
+        int queued;
+        if (w->block || ioctl(w->feed, FIONREAD, &queued) == -1) continue;
+        if (queued < best_queued) {
+            best = w;
+            best_queued = queued;
+        }
+    }
+    return best;
+}
+
+/* Stops taking input: what is pending is dropped. */
+void split_stop(Splitter *s) {
+    s->eof = true;
+    s->pending_len = s->cut = 0;
+}
+
+/* Stops taking input after an error. */
+void split_abandon(Splitter *s) {
+    s->status = EXIT_FAILURE;
+    split_stop(s);
+}
+
+/* Hands the next block to a worker if one is ready and a worker can take
+ * it. The worker takes over the pending buffer and the rest of the input
+ * moves to a new one, except that a mapped file is never copied. Returns
+ * true if a block was handed out. */
+bool split_dispatch(Splitter *s) {
+    if (!s->cut) return false;
+    SplitWorker *w = split_target(s);
+    if (!w) return false;
+    if (s->opt.keep_order && !split_launch(s, w)) {
+        fprintf(stderr, "pipe-split: %s\n", strerror(errno));
+        split_abandon(s);
+        return false;
+    }
+
+    w->block = s->pending;
+    w->len = s->cut;
+    w->sent = 0;
+    if (s->map) {
+        s->pending += s->cut;
+        s->pending_len -= s->cut;
+        split_cut(s);
+        return true;
+    }
+
+    size_t rest = s->pending_len - s->cut;
+    s->pending = malloc(s->pending_cap);
+    memcpy(s->pending, w->block + s->cut, rest);
+    s->pending_len = rest;
+    split_cut(s);
+    return true;
+}
+
+/* Writes as much of w's block as its pipe takes. A mapped block is spliced
+ * in, so the pipe reads the file's pages without a copy by the shell. With
+ * -k the job's stdin is closed after its one block. */
+void split_feed(Splitter *s, SplitWorker *w) {
+    ssize_t n;
+    if (s->map) {
+        struct iovec iov = {w->block + w->sent, w->len - w->sent};
+        n = vmsplice(w->feed, &iov, 1, SPLICE_F_NONBLOCK);
+    } else {
+        n = write(w->feed, w->block + w->sent, w->len - w->sent);
+    }
+    if (n == -1) {
+        if (errno == EAGAIN || errno == EINTR) return;
+
+        /* A worker that stops reading, as head does, has finished: what it
+         * didn't take is dropped, and its exit status tells if it failed. */
+        if (errno != EPIPE) s->status = EXIT_FAILURE;
+        w->sent = w->len;
+    } else {
+        w->sent += n;
+    }
+    if (w->sent < w->len) return;
+
+    if (!s->map) free(w->block);
+    w->block = NULL;
+    if (n == -1 || s->opt.keep_order) {
+        split_close_fd(s, &w->feed);
+        w->feed_events = 0;
+    }
+}
+
+/* Reaps w's job with -k, keeping the first failure as the status. */
+void split_reap(Splitter *s, SplitWorker *w) {
+    int status;
+    if (waitpid(w->pid, &status, 0) == -1) return;
+    int exit_val = WIFSIGNALED(status) ? 128 + WTERMSIG(status)
+                                       : WEXITSTATUS(status);
+    if (!s->status) s->status = exit_val;
+    split_close_fd(s, &w->pidfd);
+    w->pid = 0;
+}
+
+/* With -k, passes on the output of blocks in order: whatever the job of the
+ * oldest block has written so far and, once that job is done, the next. */
+bool split_emit_jobs(BuiltinIO *io, Splitter *s) {
+    while (1) {
+        SplitWorker *w = NULL;
+        for (int i = 0; i < s->num_workers && !w; i++) {
+            SplitWorker *x = &s->workers[i];
+            if (x->active && x->seq == s->emit_seq) w = x;
+        }
+        if (!w) return true;
+
+        if (w->out_len && !io_write(io, w->out, w->out_len)) return false;
+        w->out_len = 0;
+        if (w->drain != -1 || w->pid) return true;
+        w->active = false;
+        s->emit_seq++;
+    }
+}
+
+/* Reads what w has written. Without -k, complete lines are passed on right
+ * away so that workers' lines never mix; with -k output waits its turn.
+ * Returns false if the output can't be written. */
+bool split_drain(BuiltinIO *io, Splitter *s, SplitWorker *w) {
+    if (w->out_len == w->out_cap) {
+        w->out_cap = w->out_cap ? 2 * w->out_cap : BUILTIN_BUF_SIZE;
+        w->out = realloc(w->out, w->out_cap);
+    }
+    ssize_t n = read(w->drain, w->out + w->out_len, w->out_cap - w->out_len);
+    if (n == -1 && (errno == EAGAIN || errno == EINTR)) return true;
+    if (n > 0) w->out_len += n;
+
+    if (n <= 0) {
+        split_close_fd(s, &w->drain);
+
+        /* Without a pidfd the job is reaped once it closes its stdout. */
+        if (s->opt.keep_order && w->pid && w->pidfd == -1) split_reap(s, w);
+    }
+    if (s->opt.keep_order) return split_emit_jobs(io, s);
+
+    size_t len = w->out_len;
+    if (w->drain != -1) {
+        char *nl = memrchr(w->out, '\n', w->out_len);
+        len = nl ? (size_t)(nl - w->out + 1) : 0;
+    }
+    if (!len) return true;
+    if (!io_write(io, w->out, len)) return false;
+    memmove(w->out, w->out + len, w->out_len - len);
+    w->out_len -= len;
+    return true;
+}
+
+/* Whether every worker has finished: without -k every drain is closed,
+ * with -k every job's output has been passed on. */
+bool split_done(Splitter *s) {
+    if (!s->eof || s->pending_len) return false;
+    for (int i = 0; i < s->num_workers; i++) {
+        SplitWorker *w = &s->workers[i];
+        if (s->opt.keep_order ? w->active : w->drain != -1) return false;
+    }
+    return true;
+}
+
+/* Moves blocks from the input to the workers and their output to stdout
+ * until the input and every worker are done. Returns false if stopped or if
+ * the output can't be written. */
+bool split_run(BuiltinIO *io, Splitter *s) {
+    struct epoll_event events[SPLIT_WORKERS_MAX * 3 + 1];
+
+    while (!split_done(s)) {
+        if (io->cancel) return false;
+        bool busy = false;
+        while (split_dispatch(s)) busy = true;
+
+        /* Input is read only while no block is ready, which keeps it from
+         * piling up in the shell while the workers are busy. */
+        bool want_input = !s->eof && !s->cut;
+        if (want_input && s->in_always) {
+            split_read(io, s);
+            busy = true;
+        } else if (!split_watch(s, io->in, &s->in_events,
+                                want_input ? EPOLLIN : 0, SPLIT_INPUT)) {
+            s->in_always = true;
+            continue;
+        }
+
+        bool live = false;
+        for (int i = 0; i < s->num_workers; i++) {
+            SplitWorker *w = &s->workers[i];
+            if (w->feed == -1) continue;
+
+            /* A worker that has closed its stdout is gone. Don't wait for
+             * more input to find that out by writing to it; its block is
+             * dropped as in split_feed(). */
+            if (!s->opt.keep_order && w->drain == -1) {
+                if (w->block && !s->map) free(w->block);
+                w->block = NULL;
+                split_close_fd(s, &w->feed);
+                w->feed_events = 0;
+                continue;
+            }
+
+            /* At end of input each worker gets end of file after its last
+             * block. */
+            if (!w->block && s->eof && !s->pending_len) {
+                split_close_fd(s, &w->feed);
+                w->feed_events = 0;
+                continue;
+            }
+            live = true;
+            split_watch(s, w->feed, &w->feed_events, w->block ? EPOLLOUT : 0,
+                        i * 4 + SPLIT_FEED);
+        }
+        if (!live && !s->opt.keep_order && (!s->eof || s->pending_len)) {
+            split_stop(s);
+            continue;
+        }
+
+        int n = epoll_wait(s->epoll, events, SPLIT_WORKERS_MAX * 3 + 1, 0);
+        if (n <= 0) {
+            if (!busy && !io_wait(io, s->epoll, POLLIN)) return false;
+            continue;
+        }
+        for (int e = 0; e < n; e++) {
+            SplitWorker *w = &s->workers[events[e].data.u64 / 4];
+            switch (events[e].data.u64 % 4) {
+                case SPLIT_INPUT:
+                    split_read(io, s);
+                    break;
+                case SPLIT_FEED:
+                    if (w->feed != -1 && w->block) split_feed(s, w);
+                    break;
+                case SPLIT_DRAIN:
+                    if (w->drain != -1 && !split_drain(io, s, w)) return false;
+                    break;
+                case SPLIT_PIDFD:
+                    if (w->pid) split_reap(s, w);
+                    if (!split_emit_jobs(io, s)) return false;
+                    break;
+            }
+        }
+    }
+    return true;
+}
+
+/* Releases the splitter. Jobs still running after an error or a cancel are
+ * stopped and reaped; the workers of a pipeline are left to the reaper. */
+void split_free(BuiltinIO *io, Splitter *s) {
+    for (int i = 0; i < s->num_workers; i++) {
+        SplitWorker *w = &s->workers[i];
+        split_close_fd(s, &w->feed);
+        split_close_fd(s, &w->drain);
+        split_close_fd(s, &w->pidfd);
+        if (w->pid > 0) {
+            kill(w->pid, io->cancel ? io->cancel : SIGTERM);
+            waitpid(w->pid, NULL, 0);
+        }
+        if (!s->map) free(w->block);
+        free(w->out);
+    }
+    if (s->epoll != -1) close(s->epoll);
+    if (s->map)
+        munmap(s->map, s->map_len);
+    else
+        free(s->pending);
+    free(s->job);
+    free(s);
+}
+
+Splitter *split_new() {
+    Splitter *s = calloc(1, sizeof(Splitter));
+    s->epoll = -1;
+    for (int i = 0; i < SPLIT_WORKERS_MAX; i++) {
+        SplitWorker *w = &s->workers[i];
+        w->feed = w->drain = w->pidfd = -1;
+    }
+    return s;
+}
+
+/* Runs a splitter whose input is set up, with the workers run_processes()
+ * started or with -k its own jobs, and frees it. Returns the status. */
+int split_start(BuiltinIO *io, Splitter *s) {
+    /* Take over the pipes to the workers. */
+    Process *stage = io->stage;
+    for (Process *p = stage->workers; p && p != stage; p = p->next) {
+        SplitWorker *w = &s->workers[s->num_workers++];
+        w->feed = p->feed_fd;
+        w->drain = p->drain_fd;
+        p->feed_fd = p->drain_fd = -1;
+    }
+
+    s->epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (s->epoll == -1) {
+        fprintf(stderr, "%s: %s\n", io->argv[0], strerror(errno));
+        split_free(io, s);
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < s->num_workers; i++) {
+        uint32_t events = 0;
+        split_watch(s, s->workers[i].drain, &events, EPOLLIN,
+                    i * 4 + SPLIT_DRAIN);
+    }
+
+    if (s->opt.keep_order) {
+        /* Jobs run as a copy of this stage on their own pipes. */
+        s->num_workers = s->opt.jobs;
+        s->job = calloc(1, sizeof(Process));
+        s->job->argv = s->opt.cmd;
+        s->job->cmd = s->opt.cmd[0];
+        s->job->exec_path = stage->exec_path;
+        s->job->redirect_output = NO_REDIRECT;
+        s->job->here_type = NO_HERE;
+        s->job->here_fd = -1;
+    }
+
+    bool ok = split_run(io, s);
+    int status = ok ? s->status : EXIT_FAILURE;
+    split_free(io, s);
+    return status;
+}
+
+/* pipe-split [-kr] [-b SIZE] [-j N] [--] COMMAND [ARG...]
+ *
+ * Cuts its input into blocks of about SIZE bytes (1M by default) that end at
+ * a newline and feeds them to N copies of COMMAND (one per CPU by default):
+ * each block to the copy with the least input queued, or with -r to each
+ * copy in turn. Their output is merged a line at a time. The copies are
+ * stages of the pipeline, added right before this one. With -k each block
+ * runs in a job of its own instead, at most N at once, and their output
+ * comes out in block order. */
+int builtin_pipe_split(BuiltinIO *io, int argc, char **argv) {
+    Splitter *s = split_new();
+    if (!split_args(argc, argv, &s->opt)) {
+        fprintf(stderr, "usage: pipe-split [-kr] [-b SIZE] [-j N] [--] "
+                        "COMMAND [ARG...]\n");
+        split_free(io, s);
+        return EXIT_FAILURE;
+    }
+    s->pending_cap = 2 * s->opt.block;
+    s->pending = malloc(s->pending_cap);
+    return split_start(io, s);
+}
+
+/* pmap [-j N] FILE [--] COMMAND [ARG...]
+ *
+ * Maps FILE, cuts it at newlines into N ranges of about equal size and runs
+ * COMMAND on each range, at most N at once. Ranges are spliced into the
+ * jobs' stdin straight from the mapping, and their output comes out in file
+ * order. */
+int builtin_pmap(BuiltinIO *io, int argc, char **argv) {
+    Splitter *s = split_new();
+    if (!split_args(argc, argv, &s->opt)) {
+        fprintf(stderr, "usage: pmap [-j N] FILE [--] COMMAND [ARG...]\n");
+        split_free(io, s);
+        return EXIT_FAILURE;
+    }
+
+    int fd = builtin_open("pmap", s->opt.path, O_RDONLY);
+    struct stat st;
+    if (fd != -1 && (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode))) {
+        fprintf(stderr, "pmap: %s: not a regular file\n", s->opt.path);
+        close(fd);
+        fd = -1;
+    }
+    if (fd != -1 && st.st_size) {
+        s->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (s->map == MAP_FAILED) {
+            fprintf(stderr, "pmap: %s: %s\n", s->opt.path, strerror(errno));
+            s->map = NULL;
+            close(fd);
+            fd = -1;
+        }
+    }
+    if (fd == -1) {
+        split_free(io, s);
+        return EXIT_FAILURE;
+    }
+    close(fd);
+
+    s->map_len = st.st_size;
+    s->pending = s->map;
+    s->pending_len = s->map_len;
+    s->eof = true;
+    s->opt.block = (s->map_len + s->opt.jobs - 1) / s->opt.jobs;
+    if (!s->opt.block) s->opt.block = 1;
+    split_cut(s);
+    return split_start(io, s);
+}
+
+/* Whether the environment's collation is plain byte order, which is all the
+ * sort builtin does. */
+bool bytewise_collation() {
+    const char *names[] = {"LC_ALL", "LC_COLLATE", "LANG"};
+    for (int i = 0; i < 3; i++) {
+        const char *v = getenv(names[i]);
+        if (!v || !*v) continue;
+        return !strcmp(v, "C") || !strcmp(v, "POSIX") || !strncmp(v, "C.", 2);
+    }
+    return true;
+}
+
+uint64_t sort_prefix(const char *s, size_t len) {
+    uint64_t p = 0;
+    for (size_t i = 0; i < 8; i++)
+        p = (p << 8) | (i < len ? (unsigned char)s[i] : 0);
+    return p;
+}
+
+/* Compares two lines bytewise, backwards if *reverse is set. */
+int sort_compare(const void *x, const void *y, void *reverse) {
+    const SortLine *a = x, *b = y;
+    int c;
+    if (a->prefix != b->prefix) {
+        c = (a->prefix < b->prefix) ? -1 : 1;
+    } else {
+        size_t n = (a->len < b->len) ? a->len : b->len;
+        c = (n > 8) ? memcmp(a->text + 8, b->text + 8, n - 8) : 0;
+        if (!c) c = (a->len > b->len) - (a->len < b->len);
+    }
+    return *(bool *)reverse ? -c : c;
+}
+
+void *sort_slice(void *arg) {
+    SortTask *t = arg;
+    qsort_r(t->src + t->lo, t->hi - t->lo, sizeof(SortLine), sort_compare,
+            t->reverse);
+    return NULL;
+}
+
+void *merge_slices(void *arg) {
+    SortTask *t = arg;
+    size_t i = t->lo, j = t->mid, k = t->lo;
+    while (i < t->mid && j < t->hi) {
+        if (sort_compare(&t->src[j], &t->src[i], t->reverse) < 0)
+            t->dst[k++] = t->src[j++];
+        else
+            t->dst[k++] = t->src[i++];
+    }
+    memcpy(t->dst + k, t->src + i, (t->mid - i) * sizeof(SortLine));
+    k += t->mid - i;
+    memcpy(t->dst + k, t->src + j, (t->hi - j) * sizeof(SortLine));
+    return NULL;
+}
+
+/* Runs fn on each of n tasks, all but the first on threads of their own.
+ * A task whose thread can't be created runs on this one. */
+void run_tasks(void *(*fn)(void *), SortTask *tasks, int n) {
+    pthread_t threads[SORT_THREADS_MAX];
+    bool started[SORT_THREADS_MAX];
+    for (int i = 1; i < n; i++) {
+        started[i] = !pthread_create(&threads[i], NULL, fn, &tasks[i]);
+        if (!started[i]) fn(&tasks[i]);
+    }
+    if (n) fn(&tasks[0]);
+    for (int i = 1; i < n; i++) {
+        if (started[i]) pthread_join(threads[i], NULL);
+    }
+}
+
+/* Sorts the lines read so far: each thread sorts a slice of them, then pairs
+ * of neighbouring slices are merged in parallel until one is left. Without
+ * memory for the merges the whole array is sorted on this thread instead,
+ * since this runs in the shell itself. */
+void sort_lines(Sorter *s) {
+    size_t n = s->num_lines;
+    int parts = (n < SORT_PARALLEL_MIN) ? 1 : s->threads;
+    size_t bounds[SORT_THREADS_MAX + 1];
+    SortTask tasks[SORT_THREADS_MAX];
+    for (int i = 0; i <= parts; i++) bounds[i] = n * i / parts;
+    for (int i = 0; i < parts; i++)
+        tasks[i] = (SortTask){s->lines, NULL, bounds[i], 0, bounds[i + 1],
+                              &s->reverse};
+    run_tasks(sort_slice, tasks, parts);
+    if (parts == 1) return;
+
+    SortLine *src = s->lines, *dst = malloc(n * sizeof(SortLine));
+    SortLine *tmp = dst;
+    if (!dst) {
+        qsort_r(s->lines, n, sizeof(SortLine), sort_compare, &s->reverse);
+        return;
+    }
+    while (parts > 1) {
+        int merges = 0, next = 0;
+        for (int i = 0; i < parts; i += 2) {
+            if (i + 1 < parts)
+                tasks[merges++] =
+                    (SortTask){src,           dst,          bounds[i],
+                               bounds[i + 1], bounds[i + 2], &s->reverse};
+            else
+                memcpy(dst + bounds[i], src + bounds[i],
+                       (bounds[i + 1] - bounds[i]) * sizeof(SortLine));
+            bounds[next++] = bounds[i];
+        }
+        bounds[next] = n;
+        run_tasks(merge_slices, tasks, merges);
+        parts = next;
+        SortLine *swap = src;
+        src = dst;
+        dst = swap;
+    }
+    if (src != s->lines) memcpy(s->lines, src, n * sizeof(SortLine));
+    free(tmp);
+}
+
+/* Writes one line to out, or to the builtin's stdout if out is NULL. With
+ * -u a line equal to the last one is dropped. */
+bool sort_emit(BuiltinIO *io, Sorter *s, FILE *out, const SortLine *line) {
+    if (s->unique) {
+        if (s->have_last && line->len == s->last_len &&
+            !memcmp(line->text, s->last, line->len))
+            return true;
+        if (line->len > s->last_cap) {
+            s->last_cap = line->len;
+            s->last = realloc(s->last, s->last_cap);
+        }
+        memcpy(s->last, line->text, line->len);
+        s->last_len = line->len;
+        s->have_last = true;
+    }
+
+    if (out) {
+        fwrite(line->text, 1, line->len, out);
+        return putc('\n', out) != EOF;
+    }
+    return io_write(io, line->text, line->len) && io_write(io, "\n", 1);
+}
+
+/* Drops the lines read since the last spill, along with their memory. */
+void sort_reset(Sorter *s) {
+    arena_reset(&s->arena);
+    s->arena_used = 0;
+    s->num_lines = 0;
+}
+
+/* Opens an unlinked temporary file for a run. */
+FILE *sort_tmpfile() {
+    const char *dir = getenv("TMPDIR");
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/sshell-sort-XXXXXX",
+             (dir && *dir) ? dir : "/tmp");
+    int fd = mkostemp(path, O_CLOEXEC);
+    if (fd == -1) return NULL;
+    unlink(path);
+    FILE *f = fdopen(fd, "w+");
+    if (!f) close(fd);
+    return f;
+}
+
+/* Reads the next line of a run into its cur. Returns false at its end. */
+bool sort_run_next(SortRun *r) {
+    ssize_t n = getline(&r->buf, &r->cap, r->file);
+    if (n <= 0) return false;
+    if (r->buf[n - 1] == '\n') n--;
+    r->cur = (SortLine){sort_prefix(r->buf, n), r->buf, n};
+    return true;
+}
+
+/* Moves heap[i] down to its place in a heap of runs ordered by their
+ * current lines. */
+void sort_sift(Sorter *s, int *heap, int n, int i) {
+    while (1) {
+        int least = i, l = 2 * i + 1, r = l + 1;
+        if (l < n && sort_compare(&s->runs[heap[l]].cur,
+                                  &s->runs[heap[least]].cur, &s->reverse) < 0)
+            least = l;
+        if (r < n && sort_compare(&s->runs[heap[r]].cur,
+                                  &s->runs[heap[least]].cur, &s->reverse) < 0)
+            least = r;
+        if (least == i) return;
+        int swap = heap[i];
+        heap[i] = heap[least];
+        heap[least] = swap;
+        i = least;
+    }
+}
+
+/* Merges every run into out, or into the builtin's stdout if out is NULL,
+ * and closes them. */
+bool sort_merge(BuiltinIO *io, Sorter *s, FILE *out) {
+    int heap[SORT_RUNS_MAX], n = 0;
+    for (int i = 0; i < s->num_runs; i++) {
+        rewind(s->runs[i].file);
+        if (sort_run_next(&s->runs[i])) heap[n++] = i;
+    }
+    for (int i = n / 2 - 1; i >= 0; i--) sort_sift(s, heap, n, i);
+
+    bool ok = true;
+    s->have_last = false;
+    while (ok && n) {
+        SortRun *r = &s->runs[heap[0]];
+        ok = sort_emit(io, s, out, &r->cur);
+        if (!sort_run_next(r)) heap[0] = heap[--n];
+        sort_sift(s, heap, n, 0);
+    }
+
+    for (int i = 0; i < s->num_runs; i++) {
+        fclose(s->runs[i].file);
+        free(s->runs[i].buf);
+    }
+    s->num_runs = 0;
+    return ok;
+}
+
+/* Sorts the lines read so far into a new run. With the most runs already
+ * open, those are first merged into one. */
+bool sort_spill(BuiltinIO *io, Sorter *s) {
+    if (s->num_runs == SORT_RUNS_MAX) {
+        FILE *merged = sort_tmpfile();
+        if (!merged || !sort_merge(io, s, merged) || fflush(merged)) {
+            fprintf(stderr, "sort: %s\n", strerror(errno));
+            if (merged) fclose(merged);
+            return false;
+        }
+        s->runs[s->num_runs++] = (SortRun){merged, NULL, 0, {0, NULL, 0}};
+    }
+
+    FILE *f = sort_tmpfile();
+    if (!f) {
+        fprintf(stderr, "sort: %s\n", strerror(errno));
+        return false;
+    }
+    sort_lines(s);
+    s->have_last = false;
+    bool ok = true;
+    for (size_t i = 0; ok && i < s->num_lines; i++)
+        ok = sort_emit(io, s, f, &s->lines[i]);
+    if (!ok || fflush(f)) {
+        fprintf(stderr, "sort: %s\n", strerror(errno));
+        fclose(f);
+        return false;
+    }
+    s->runs[s->num_runs++] = (SortRun){f, NULL, 0, {0, NULL, 0}};
+    sort_reset(s);
+    return true;
+}
+
+/* Records a line. Returns false if the array of lines can't grow. */
+bool sort_add(Sorter *s, const char *text, size_t len) {
+    if (s->num_lines == s->cap_lines) {
+        size_t cap = s->cap_lines ? 2 * s->cap_lines : 4096;
+        SortLine *lines = realloc(s->lines, cap * sizeof(SortLine));
+        if (!lines) {
+            fprintf(stderr, "sort: %s\n", strerror(errno));
+            return false;
+        }
+        s->lines = lines;
+        s->cap_lines = cap;
+    }
+    s->lines[s->num_lines++] = (SortLine){sort_prefix(text, len), text, len};
+    return true;
+}
+
+/* Reads fd into arena buffers and records its lines, spilling a sorted run
+ * whenever they outgrow the memory budget. The budget also counts the array
+ * of lines and the scratch array a parallel sort merges into. */
+bool sort_read(BuiltinIO *io, Sorter *s, int fd, bool nonblock) {
+    size_t cap = SORT_READ_SIZE, len = 0, start = 0;
+    char *buf = arena_alloc(&s->arena, cap);
+    s->arena_used += cap;
+
+    while (1) {
+        ssize_t n = io_read_fd(io, fd, nonblock, buf + len, cap - len);
+        if (n < 0) return false;
+        len += n;
+
+        char *nl;
+        while ((nl = memchr(buf + start, '\n', len - start))) {
+            if (!sort_add(s, buf + start, nl - (buf + start))) return false;
+            start = nl - buf + 1;
+        }
+        if (!n) return start == len || sort_add(s, buf + start, len - start);
+        if (len < cap) continue;
+
+        /* The buffer is full: carry its last partial line over to a new
+         * one, spilling first if memory has run out. */
+        size_t rest = len - start;
+        char *carry = NULL;
+        size_t records = (s->cap_lines + s->num_lines) * sizeof(SortLine);
+        if (s->arena_used + records >= s->budget && s->num_lines) {
+            carry = malloc(rest);
+            if (!carry) {
+                fprintf(stderr, "sort: %s\n", strerror(errno));
+                return false;
+            }
+            memcpy(carry, buf + start, rest);
+            if (!sort_spill(io, s)) {
+                free(carry);
+                return false;
+            }
+        }
+        cap = (rest * 2 > SORT_READ_SIZE) ? rest * 2 : SORT_READ_SIZE;
+        char *next = arena_alloc(&s->arena, cap);
+        s->arena_used += cap;
+        memcpy(next, carry ? carry : buf + start, rest);
+        free(carry);
+        buf = next;
+        len = rest;
+        start = 0;
+    }
+}
+
+/* sort [-ru] [-S SIZE] [FILE...]
+ *
+ * Sorts lines bytewise (as under LC_ALL=C) on one thread per CPU. Past SIZE
+ * bytes of memory (256M by default) sorted runs are spilled to files in
+ * $TMPDIR and merged at the end. -r reverses the order and -u drops repeated
+ * lines. */
+int builtin_sort(BuiltinIO *io, int argc, char **argv) {
+    Sorter *s = calloc(1, sizeof(Sorter));
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    s->threads = (cpus < 1) ? 1 : cpus;
+    if (s->threads > SORT_THREADS_MAX) s->threads = SORT_THREADS_MAX;
+    s->budget = SORT_BUDGET_DEFAULT;
+
+    int opt;
+    while ((opt = builtin_getopt(&io->opt, argc, argv, "ruS:")) != -1) {
+        unsigned long size;
+        if (opt == 'r') {
+            s->reverse = true;
+        } else if (opt == 'u') {
+            s->unique = true;
+        } else if (parse_size(io->opt.arg, &size)) {
+            s->budget = size;
+        } else {
+            fprintf(stderr, "sort: invalid buffer size: '%s'\n",
+                    io->opt.arg);
+            free(s);
+            return EXIT_FAILURE;
+        }
+    }
+
+    bool ok = true;
+    if (io->opt.ind == argc) ok = sort_read(io, s, io->in, io->in_nonblock);
+    for (int i = io->opt.ind; ok && i < argc; i++) {
+        int fd = builtin_open("sort", argv[i], O_RDONLY);
+        ok = fd != -1 && sort_read(io, s, fd, true);
+        if (fd != -1) close(fd);
+    }
+
+    if (ok && !s->num_runs) {
+        sort_lines(s);
+        for (size_t i = 0; ok && i < s->num_lines; i++)
+            ok = sort_emit(io, s, NULL, &s->lines[i]);
+    } else if (ok) {
+        ok = (!s->num_lines || sort_spill(io, s)) && sort_merge(io, s, NULL);
+    }
+
+    for (int i = 0; i < s->num_runs; i++) {
+        fclose(s->runs[i].file);
+        free(s->runs[i].buf);
+    }
+    arena_free(&s->arena);
+    free(s->lines);
+    free(s->last);
+    free(s);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* Hashes n bytes eight at a time, for keys longer than command names. */
+uint32_t hash_bytes(const char *s, size_t n) {
+    uint64_t h = n * 0x9e3779b97f4a7c15ULL, w;
+    for (; n >= 8; s += 8, n -= 8) {
+        memcpy(&w, s, 8);
+        h = (h ^ w) * 0xff51afd7ed558ccdULL;
+        h ^= h >> 32;
+    }
+    w = 0;
+    memcpy(&w, s, n);
+    h = (h ^ w) * 0xc4ceb9fe1a85ec53ULL;
+    return (uint32_t)(h ^ (h >> 32));
+}
+
+/* Doubles the table, rehashing from the hashes kept in the slots. */
+void count_grow(Counter *c) {
+    size_t mask = 2 * (c->mask + 1) - 1;
+    CountSlot *slots = calloc(mask + 1, sizeof(CountSlot));
+    for (size_t i = 0; i <= c->mask; i++) {
+        if (!c->slots[i].index) continue;
+        size_t j = c->slots[i].hash & mask;
+        while (slots[j].index) j = (j + 1) & mask;
+        slots[j] = c->slots[i];
+    }
+    free(c->slots);
+    c->slots = slots;
+    c->mask = mask;
+}
+
+void count_key(Counter *c, const char *key, size_t len) {
+    uint32_t h = hash_bytes(key, len);
+    size_t i = h & c->mask;
+    for (; c->slots[i].index; i = (i + 1) & c->mask) {
+        CountEntry *e = &c->entries[c->slots[i].index - 1];
+        if (c->slots[i].hash == h && e->len == len &&
+            !memcmp(e->key, key, len)) {
+            e->count++;
+            return;
+        }
+    }
+
+    if (c->num_entries == c->cap_entries) {
+        c->cap_entries = c->cap_entries ? 2 * c->cap_entries : 4096;
+        c->entries =
+            realloc(c->entries, c->cap_entries * sizeof(CountEntry));
+    }
+    char *copy = arena_alloc(&c->arena, len);
+    memcpy(copy, key, len);
+    c->entries[c->num_entries++] = (CountEntry){copy, len, 1};
+    c->slots[i] = (CountSlot){h, c->num_entries};
+    if (c->num_entries * 2 > c->mask + 1) count_grow(c);
+}
+
+/* Counts the key of one line: the whole line, or its chosen field. A line
+ * without that field counts as an empty key, as with awk. */
+void count_line(Counter *c, const char *s, size_t len) {
+    const char *end = s + len;
+    if (!c->field) {
+        count_key(c, s, len);
+    } else if (c->delim) {
+        for (int i = 1; i < c->field && s < end; i++) {
+            const char *d = memchr(s, c->delim, end - s);
+            s = d ? d + 1 : end;
+        }
+        const char *d = memchr(s, c->delim, end - s);
+        count_key(c, s, (d ? d : end) - s);
+    } else {
+        const char *f = s;
+        for (int i = 0; i < c->field; i++) {
+            while (s < end && (*s == ' ' || *s == '\t')) s++;
+            f = s;
+            while (s < end && *s != ' ' && *s != '\t') s++;
+        }
+        count_key(c, f, s - f);
+    }
+}
+
+/* Reads fd and counts each of its lines. */
+bool count_read(BuiltinIO *io, Counter *c, int fd, bool nonblock) {
+    size_t len = 0;
+    while (1) {
+        if (len == c->buf_cap) {
+            c->buf_cap *= 2;
+            c->buf = realloc(c->buf, c->buf_cap);
+        }
+        ssize_t n =
+            io_read_fd(io, fd, nonblock, c->buf + len, c->buf_cap - len);
+        if (n < 0) return false;
+        len += n;
+
+        size_t start = 0;
+        char *nl;
+        while ((nl = memchr(c->buf + start, '\n', len - start))) {
+            count_line(c, c->buf + start, nl - (c->buf + start));
+            start = nl - c->buf + 1;
+        }
+        if (!n) {
+            if (start < len) count_line(c, c->buf + start, len - start);
+            return true;
+        }
+        len -= start;
+        memmove(c->buf, c->buf + start, len);
+    }
+}
+
+/* Whether entry a ranks above entry b: counted more often, or as often but
+ * seen first. */
+bool count_above(const Counter *c, size_t a, size_t b) {
+    if (c->entries[a].count != c->entries[b].count)
+        return c->entries[a].count > c->entries[b].count;
+    return a < b;
+}
+
+/* Moves heap[i] down to its place in a heap with the lowest ranked entry on
+ * top. */
+void count_sift(const Counter *c, size_t *heap, size_t n, size_t i) {
+    while (1) {
+        size_t low = i, l = 2 * i + 1, r = l + 1;
+        if (l < n && count_above(c, heap[low], heap[l])) low = l;
+        if (r < n && count_above(c, heap[low], heap[r])) low = r;
+        if (low == i) return;
+        size_t swap = heap[i];
+        heap[i] = heap[low];
+        heap[low] = swap;
+        i = low;
+    }
+}
+
+/* Returns the top entries in rank order, keeping the best k seen so far in
+ * a heap. Sets *n to how many there are. */
+size_t *count_top(const Counter *c, size_t k, size_t *n) {
+    if (k > c->num_entries) k = c->num_entries;
+    size_t *heap = malloc((k ? k : 1) * sizeof(size_t));
+    for (size_t i = 0; i < k; i++) heap[i] = i;
+    for (size_t i = k / 2; i-- > 0;) count_sift(c, heap, k, i);
+    for (size_t i = k; k && i < c->num_entries; i++) {
+        if (!count_above(c, i, heap[0])) continue;
+        heap[0] = i;
+        count_sift(c, heap, k, 0);
+    }
+
+    /* Popping the lowest to the back leaves the best at the front. */
+    for (size_t end = k; end > 1; end--) {
+        size_t swap = heap[0];
+        heap[0] = heap[end - 1];
+        heap[end - 1] = swap;
+        count_sift(c, heap, end - 1, 0);
+    }
+    *n = k;
+    return heap;
+}
+
+bool count_print(BuiltinIO *io, const CountEntry *e) {
+    return io_printf(io, "%7lu ", e->count) && io_write(io, e->key, e->len) &&
+           io_write(io, "\n", 1);
+}
+
+/* count [-f N] [-d DELIM] [-n K] [FILE...]
+ *
+ * Counts how often each line occurs, like sort | uniq -c but in one pass
+ * over a hash table, and prints the counts in order of first appearance.
+ * -f counts field N instead, split at DELIM or at runs of blanks. -n prints
+ * only the K most frequent, most frequent first. */
+int builtin_count(BuiltinIO *io, int argc, char **argv) {
+    Counter c = {0};
+    long top = -1;
+    int opt;
+    while ((opt = builtin_getopt(&io->opt, argc, argv, "d:f:n:")) != -1) {
+        char *end;
+        if (opt == 'd') {
+            c.delim = io->opt.arg[0];
+            if (!c.delim || io->opt.arg[1]) {
+                fprintf(stderr, "count: the delimiter must be a single "
+                                "character\n");
+                return EXIT_FAILURE;
+            }
+        } else if (opt == 'f') {
+            long field = strtol(io->opt.arg, &end, 10);
+            if (*end || field < 1 || field > INT_MAX) {
+                fprintf(stderr, "count: invalid field: '%s'\n", io->opt.arg);
+                return EXIT_FAILURE;
+            }
+            c.field = field;
+        } else {
+            top = strtol(io->opt.arg, &end, 10);
+            if (*end || top < 0) {
+                fprintf(stderr, "count: invalid number of keys: '%s'\n",
+                        io->opt.arg);
+                return EXIT_FAILURE;
+            }
+        }
+    }
+
+    c.buf_cap = COUNT_READ_SIZE;
+    c.buf = malloc(c.buf_cap);
+    c.mask = COUNT_SLOTS_MIN - 1;
+    c.slots = calloc(COUNT_SLOTS_MIN, sizeof(CountSlot));
+
+    bool ok = true;
+    if (io->opt.ind == argc) ok = count_read(io, &c, io->in, io->in_nonblock);
+    for (int i = io->opt.ind; ok && i < argc; i++) {
+        int fd = builtin_open("count", argv[i], O_RDONLY);
+        ok = fd != -1 && count_read(io, &c, fd, true);
+        if (fd != -1) close(fd);
+    }
+
+    if (ok && top < 0) {
+        for (size_t i = 0; ok && i < c.num_entries; i++)
+            ok = count_print(io, &c.entries[i]);
+    } else if (ok) {
+        size_t n;
+        size_t *order = count_top(&c, top, &n);
+        for (size_t i = 0; ok && i < n; i++)
+            ok = count_print(io, &c.entries[order[i]]);
+        free(order);
+    }
+
+    free(c.buf);
+    free(c.slots);
+    free(c.entries);
+    arena_free(&c.arena);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* Parses a field list such as 1,3-5,7- into f's ranges. */
+bool field_list(Fielder *f, const char *list) {
+    int n = 1;
+    for (const char *s = list; *s; s++) n += *s == ',';
+    f->ranges = malloc(n * sizeof(FieldRange));
+    f->num_ranges = f->last = 0;
+
+    const char *s = list;
+    for (int i = 0; i < n; i++) {
+        char *end;
+        long lo = 1, hi = INT_MAX;
+        bool open_lo = *s == '-';
+        if (!open_lo) {
+            lo = strtol(s, &end, 10);
+            if (end == s || lo < 1 || lo > INT_MAX) return false;
+            hi = lo;
+            s = end;
+        }
+        if (*s == '-') {
+            s++;
+            hi = INT_MAX;
+            if (*s && *s != ',') {
+                hi = strtol(s, &end, 10);
+                if (end == s || hi < lo || hi > INT_MAX) return false;
+                s = end;
+            } else if (open_lo) {
+                return false;
+            }
+        }
+        if (*s && *s != ',') return false;
+        if (*s) s++;
+        f->ranges[f->num_ranges++] = (FieldRange){lo, hi};
+        if (hi > f->last) f->last = hi;
+    }
+    return true;
+}
+
+bool field_selected(const Fielder *f, int index) {
+    for (int i = 0; i < f->num_ranges; i++) {
+        if (index >= f->ranges[i].lo && index <= f->ranges[i].hi) return true;
+    }
+    return false;
+}
+
+/* Returns the first byte of [p, end) the scanner stops at, or end. With
+ * SSE2 it compares 16 bytes at a time against the delimiters and newline,
+ * and sc keeps the rest of the block's hits for the next call. The stops
+ * table, like the lexer's char_class, covers the tail. */
+const char *field_scan(const Fielder *f, FieldScan *sc, const char *p,
+                       const char *end) {
+#ifdef __SSE2__
+    if (sc->block && p >= sc->block && p < sc->block + 16) {
+        unsigned mask = sc->mask & (~0U << (p - sc->block));
+        if (mask) return sc->block + __builtin_ctz(mask);
+        p = sc->block + 16;
+    }
+    const __m128i nl = _mm_set1_epi8('\n');
+    const __m128i d1 = _mm_set1_epi8(f->delim ? f->delim : ' ');
+    const __m128i d2 = _mm_set1_epi8(f->delim ? f->delim : '\t');
+    for (; end - p >= 16; p += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        __m128i hit = _mm_or_si128(
+            _mm_cmpeq_epi8(v, nl),
+            _mm_or_si128(_mm_cmpeq_epi8(v, d1), _mm_cmpeq_epi8(v, d2)));
+        unsigned mask = _mm_movemask_epi8(hit);
+        if (mask) {
+            sc->block = p;
+            sc->mask = mask;
+            return p + __builtin_ctz(mask);
+        }
+    }
+    sc->block = NULL;
+#else
+    (void)sc;
+#endif
+    while (p < end && !f->stops[(unsigned char)*p]) p++;
+    return p;
+}
+
+/* Writes one selected field, after a separator unless it is the line's
+ * first. Fields go from the read buffer straight to the output buffer. */
+bool field_put(BuiltinIO *io, const Fielder *f, const char *s,
+               const char *end, bool *printed) {
+    char sep = f->delim ? f->delim : ' ';
+    if (*printed && !io_write(io, &sep, 1)) return false;
+    *printed = true;
+    return io_write(io, s, end - s);
+}
+
+/* Prints the selected fields of every whole line in buf[0, len), and of an
+ * unterminated last line at eof. Returns how many bytes were used, or -1 if
+ * writing failed. A line without the delimiter is printed whole, as cut
+ * does. Splitting at blanks, runs of them count as one and those at either
+ * end of the line are ignored, as awk does. */
+ssize_t field_lines(BuiltinIO *io, const Fielder *f, const char *buf,
+                    size_t len, bool eof) {
+    const char *end = buf + len, *line = buf, *start = buf, *p = buf;
+    if (!eof) {
+        /* Only whole lines, so no field is printed twice. */
+        const char *nl = memrchr(buf, '\n', len);
+        if (!nl) return 0;
+        end = nl + 1;
+    }
+    FieldScan sc = {NULL, 0};
+    int index = 1;
+    bool split = false, printed = false;
+    while (1) {
+        /* Past the last selected field only the newline matters. */
+        if (index > f->last) {
+            const char *nl = memchr(p, '\n', end - p);
+            p = nl ? nl : end;
+        } else {
+            p = field_scan(f, &sc, p, end);
+        }
+        if (p == end && line == end) return end - buf;
+
+        if (p < end && *p != '\n') {
+            if (f->delim || p > start) {
+                if (field_selected(f, index) &&
+                    !field_put(io, f, start, p, &printed))
+                    return -1;
+                index++;
+                split = true;
+            }
+            start = ++p;
+            continue;
+        }
+
+        bool ok = true;
+        if (f->delim && !split)
+            ok = io_write(io, line, p - line);
+        else if (index <= f->last && (f->delim || p > start) &&
+                 field_selected(f, index))
+            ok = field_put(io, f, start, p, &printed);
+        if (!ok || !io_write(io, "\n", 1)) return -1;
+        if (p == end) return end - buf;
+        line = start = ++p;
+        index = 1;
+        split = printed = false;
+    }
+}
+
+/* Reads fd and prints the selected fields of its lines. */
+bool field_read(BuiltinIO *io, Fielder *f, int fd, bool nonblock) {
+    size_t len = 0;
+    while (1) {
+        if (len == f->buf_cap) {
+            f->buf_cap *= 2;
+            f->buf = realloc(f->buf, f->buf_cap);
+        }
+        ssize_t n =
+            io_read_fd(io, fd, nonblock, f->buf + len, f->buf_cap - len);
+        if (n < 0) return false;
+        len += n;
+
+        ssize_t used = field_lines(io, f, f->buf, len, !n);
+        if (used < 0) return false;
+        if (!n) return true;
+        len -= used;
+        memmove(f->buf, f->buf + used, len);
+    }
+}
+
+/* field [-w | -d DELIM] -f LIST [FILE...]
+ *
+ * Prints the fields of each line named by LIST, such as 1,3-5,7-, like
+ * cut -f. Fields are split at DELIM, a tab by default, or with -w at runs
+ * of blanks like awk, and printed joined by DELIM or a space. */
+int builtin_field(BuiltinIO *io, int argc, char **argv) {
+    Fielder f = {0};
+    f.delim = '\t';
+    const char *list = NULL;
+    int opt;
+    while ((opt = builtin_getopt(&io->opt, argc, argv, "d:f:w")) != -1) {
+        if (opt == 'd') {
+            f.delim = io->opt.arg[0];
+            if (!f.delim || f.delim == '\n' || io->opt.arg[1]) {
+                fprintf(stderr, "field: the delimiter must be a single "
+                                "character\n");
+                return EXIT_FAILURE;
+            }
+        } else if (opt == 'f') {
+            list = io->opt.arg;
+        } else {
+            f.delim = 0;
+        }
+    }
+    if (!list) {
+        fprintf(stderr, "field: no field list given\n");
+        return EXIT_FAILURE;
+    }
+    if (!field_list(&f, list)) {
+        fprintf(stderr, "field: invalid field list: '%s'\n", list);
+        free(f.ranges);
+        return EXIT_FAILURE;
+    }
+
+    f.stops['\n'] = true;
+    if (f.delim) {
+        f.stops[(unsigned char)f.delim] = true;
+    } else {
+        f.stops[' '] = f.stops['\t'] = true;
+    }
+    f.buf_cap = FIELD_READ_SIZE;
+    f.buf = malloc(f.buf_cap);
+
+    bool ok = true;
+    if (io->opt.ind == argc) ok = field_read(io, &f, io->in, io->in_nonblock);
+    for (int i = io->opt.ind; ok && i < argc; i++) {
+        int fd = builtin_open("field", argv[i], O_RDONLY);
+        ok = fd != -1 && field_read(io, &f, fd, true);
+        if (fd != -1) close(fd);
+    }
+
+    free(f.buf);
+    free(f.ranges);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* Builtins run inside the shell, sorted by name. */
+const Builtin shell_builtins[] = {
+    {"count", "d:f:n:", builtin_count},
+    {"field", "d:f:w", builtin_field},
+    {"head", "n:", builtin_head},
+    {"pipe-split", "b:j:kr", builtin_pipe_split},
+    {"pmap", "j:", builtin_pmap},
+    {"pwd", NULL, builtin_pwd},
+    {"set", NULL, builtin_set},
+    {"sls", NULL, builtin_sls},
+    {"sort", "ruS:", builtin_sort},
+    {"stats", NULL, builtin_stats},
+    {"tee", "a", builtin_tee},
+    {"wc", "clw", builtin_wc},
+};
+
+/* Returns the builtin that runs argv inside the shell, or NULL if argv names
+ * none or uses an option it doesn't know. */
+const Builtin *find_shell_builtin(char **argv) {
+    size_t count = sizeof(shell_builtins) / sizeof(shell_builtins[0]);
+    const Builtin *b = NULL;
+    for (size_t i = 0; i < count && !b; i++) {
+        if (!strcmp(argv[0], shell_builtins[i].name)) b = &shell_builtins[i];
+    }
+    if (!b || !b->opts) return b;
+
+    /* sort only compares bytes; other collations need the real one. */
+    if (b->run == builtin_sort && !bytewise_collation()) return NULL;
+
+    int argc = 0, opt;
+    while (argv[argc]) argc++;
+    OptState st = {1, 0, NULL};
+    while ((opt = builtin_getopt(&st, argc, argv, b->opts)) != -1) {
+        if (opt == '?') return NULL;
+    }
+    return b;
+}
+
+void run_builtin(BuiltinIO *io) {
+    int argc = 0;
+    while (io->argv[argc]) argc++;
+    io->opt = (OptState){1, 0, NULL};
+    io->status = io->builtin->run(io, argc, io->argv);
+    if (io->len) io_flush(io);
+}
+
+/* The builtin a coroutine is starting, read by its entry point. */
+BuiltinIO *starting_builtin;
+
+void builtin_entry() {
+    BuiltinIO *io = starting_builtin;
+    run_builtin(io);
+    io->co.done = true;
+}
+
+/* Adds one to an eventfd. Its 8-byte writes are never short, so only an
+ * interrupted one is retried; a lost wake-up would stall the event loop. */
+void eventfd_signal(int fd) {
+    uint64_t one = 1;
+    while (write(fd, &one, sizeof(one)) != sizeof(one)) {
+        if (errno != EINTR) {
+            perror("eventfd write");
+            return;
+        }
+    }
+}
+
+/* Runs builtins handed to a worker until the shell exits. Signals are left
+ * to the main thread. */
+void *worker_main(void *arg) {
+    Worker *w = arg;
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);
+
+    pthread_mutex_lock(&pool.lock);
+    while (1) {
+        while (!w->job) pthread_cond_wait(&w->work, &pool.lock);
+        BuiltinIO *io = w->job;
+        pthread_mutex_unlock(&pool.lock);
+
+        run_builtin(io);
+
+        pthread_mutex_lock(&pool.lock);
+        w->job = NULL;
+
+        /* The last use of io: once done_fd is readable the shell frees it. */
+        eventfd_signal(io->done_fd);
+    }
+    return NULL;
+}
+
+/* Hands io to an idle worker, starting one if fewer than THREAD_POOL_SIZE
+ * are running. Returns false if all are busy. */
+bool pool_submit(BuiltinIO *io) {
+    bool ok = false;
+    pthread_mutex_lock(&pool.lock);
+    for (int i = 0; i < THREAD_POOL_SIZE && !ok; i++) {
+        Worker *w = &pool.workers[i];
+        if (w->job) continue;
+        if (!w->started) {
+            pthread_cond_init(&w->work, NULL);
+            if (pthread_create(&w->thread, NULL, worker_main, w)) continue;
+            w->started = true;
+        }
+        w->job = io;
+        pthread_cond_signal(&w->work);
+        ok = true;
+    }
+    pthread_mutex_unlock(&pool.lock);
+    return ok;
+}
+
+/* Forgets the workers in a forked child, where they don't exist. */
+void pool_reset() {
+    memset(&pool, 0, sizeof(pool));
+    pthread_mutex_init(&pool.lock, NULL);
+}
+
+/* Writes all of buf to fd, resuming after short writes. */
+void write_all(int fd, const char *buf, size_t len) {
+    while (len) {
+        ssize_t n = write(fd, buf, len);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return;
+        buf += n;
+        len -= n;
+    }
+}
+
+/* Sends completion records to the given file, appending to it, instead of
+ * stderr. */
+bool report_open(const char *path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1) return false;
+    reporter.fd = fd;
+    return true;
+}
+
+/* Writes out the batched completion records. */
+void report_flush() {
+    write_all(reporter.fd, reporter.buf, reporter.len);
+    reporter.len = 0;
+}
+
+/* Flushes the batch if no more input is waiting, so records aren't held
+ * back while the shell would block on a read. */
+void report_idle() {
+    if (!reporter.batch || !reporter.len) return;
+    struct pollfd in = {STDIN_FILENO, POLLIN, 0};
+    if (poll(&in, 1, 0) != 1) report_flush();
+}
+
+/* Emits one completion record: written right away, or added to the batch. */
+void report_record(const char *line, size_t len) {
+    if (!reporter.batch) {
+        write_all(reporter.fd, line, len);
+        return;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (reporter.len + len > sizeof(reporter.buf)) report_flush();
+    if (!reporter.len) reporter.oldest = now;
+    memcpy(reporter.buf + reporter.len, line, len);
+    reporter.len += len;
+
+    long age_ms = (now.tv_sec - reporter.oldest.tv_sec) * 1000 +
+                  (now.tv_nsec - reporter.oldest.tv_nsec) / 1000000;
+    if (age_ms >= REPORT_FLUSH_MS) report_flush();
+}
+
+void json_raw(JsonBuf *j, const char *s, size_t n) {
+    if (j->len + n > j->cap) {
+        j->overflow = true;
+        return;
+    }
+    memcpy(j->buf + j->len, s, n);
+    j->len += n;
+}
+
+void json_lit(JsonBuf *j, const char *s) { json_raw(j, s, strlen(s)); }
+
+/* Starts a member of the current object, adding the comma unless it is the
+ * first. */
+void json_key(JsonBuf *j, const char *key) {
+    if (j->len && j->buf[j->len - 1] != '{') json_lit(j, ",");
+    json_lit(j, "\"");
+    json_lit(j, key);
+    json_lit(j, "\":");
+}
+
+/* Writes s as a JSON string, escaping quotes, backslashes and control
+ * characters. */
+void json_string(JsonBuf *j, const char *s) {
+    static const char hex[] = "0123456789abcdef";
+    json_lit(j, "\"");
+    for (const char *run = s;; s++) {
+        unsigned char c = *s;
+        if (c >= 0x20 && c != '"' && c != '\\') continue;
+
+        json_raw(j, run, s - run);
+        if (!c) break;
+        char esc[6] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 15]};
+        if (c == '"' || c == '\\') {
+            esc[1] = c;
+            json_raw(j, esc, 2);
+        } else {
+            json_raw(j, esc, 6);
+        }
+        run = s + 1;
+    }
+    json_lit(j, "\"");
+}
+
+void json_int(JsonBuf *j, const char *key, long long value) {
+    char num[32];
+    json_key(j, key);
+    json_raw(j, num, snprintf(num, sizeof(num), "%lld", value));
+}
+
+long long elapsed_ns(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000000LL +
+           (now.tv_nsec - start->tv_nsec);
+}
+
+long long timeval_us(struct timeval tv) {
+    return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+/* Serializes the completion of a pipeline as one NDJSON line into a
+ * preallocated buffer. Stages that don't fit are left out and the record is
+ * marked truncated. */
+void print_json_result(Pipeline *pl) {
+    static char record[REPORT_RECORD_MAX];
+
+    /* Room kept back for closing the record. */
+    JsonBuf j = {record, 0, sizeof(record) - 64, false};
+
+    json_lit(&j, "{");
+    json_int(&j, "seq", ++reporter.seq);
+    json_key(&j, "cmdline");
+    json_string(&j, pl->cmdline);
+    json_int(&j, "status", pl->status);
+    json_int(&j, "wall_us", pl->wall_ns / 1000);
+    json_key(&j, "stages");
+    json_lit(&j, "[");
+
+    bool first = true;
+    for (Process *cur = pl->head; cur; cur = cur->next) {
+        if (cur->split) continue;
+        size_t before = j.len;
+        int st = cur->wait_status;
+        bool killed = WIFSIGNALED(st);
+        json_lit(&j, first ? "{" : ",{");
+        first = false;
+        json_key(&j, "argv0");
+        if (cur->cmd)
+            json_string(&j, cur->cmd);
+        else
+            json_lit(&j, "null");
+        json_int(&j, "exit", cur->exit_val);
+        json_int(&j, "signal", killed ? WTERMSIG(st) : 0);
+        json_key(&j, "core");
+        json_lit(&j, (killed && WCOREDUMP(st)) ? "true" : "false");
+        json_int(&j, "utime_us", timeval_us(cur->rusage.ru_utime));
+        json_int(&j, "stime_us", timeval_us(cur->rusage.ru_stime));
+        json_int(&j, "maxrss_kb", cur->rusage.ru_maxrss);
+        json_lit(&j, "}");
+        if (j.overflow) {
+            j.len = before;
+            break;
+        }
+    }
+
+    bool truncated = j.overflow;
+    j.cap = sizeof(record);
+    json_lit(&j, "]");
+    if (truncated) {
+        json_key(&j, "truncated");
+        json_lit(&j, "true");
+    }
+    json_lit(&j, "}\n");
+    report_record(record, j.len);
+}
+
+void print_result(Pipeline *pl) {
+    /* Command lists run for a substitution report nothing. */
+    if (in_subshell) return;
+    if (reporter.json) {
+        print_json_result(pl);
+        return;
+    }
+
+    /* Build the whole line first: stderr is unbuffered, so separate prints
+     * would each be a write. */
+    char line[REPORT_LINE_MAX];
+    size_t max = sizeof(line) - 1;
+    size_t len = snprintf(line, max, "+ completed '%s' ", pl->cmdline);
+    for (Process *cur = pl->head; cur && len < max; cur = cur->next) {
+        if (!cur->split)
+            len += snprintf(line + len, max - len, "[%d]", cur->exit_val);
+    }
+    if (len > max - 1) len = max - 1;
+    line[len++] = '\n';
+    report_record(line, len);
+}
+
+/* Connects consecutive processes of a pipeline with pipes. */
+void create_pipes(Process *head) {
+    Process *cur = head;
+    while (cur) {
+        if (cur->next) {
+            int fd[2];
+            pipe(fd);
+            cur->out = fd[1];
+            cur->next->in = fd[0];
+        }
+        cur = cur->next;
+    }
+}
+
+void uring_close(Uring *r) {
+    if (r->sq_ring) munmap(r->sq_ring, r->sq_size);
+    if (r->cq_ring) munmap(r->cq_ring, r->cq_size);
+    if (r->sqes) munmap(r->sqes, r->sqes_size);
+    close(r->fd);
+}
+
+/* Maps the rings of a new io_uring instance. Returns false if io_uring is
+ * unavailable, e.g. on kernels before 5.1 or where it is disabled. */
+bool uring_setup(Uring *r, unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = syscall(SYS_io_uring_setup, entries, &p);
+    if (fd == -1) return false;
+
+    memset(r, 0, sizeof(*r));
+    r->fd = fd;
+    r->entries = p.sq_entries;
+    r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    /* Since 5.4 both rings come from one mapping. */
+    bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single && r->cq_size > r->sq_size) r->sq_size = r->cq_size;
+
+    int prot = PROT_READ | PROT_WRITE, flags = MAP_SHARED | MAP_POPULATE;
+    char *sq = mmap(NULL, r->sq_size, prot, flags, fd, IORING_OFF_SQ_RING);
+    char *cq = single ? sq
+                      : mmap(NULL, r->cq_size, prot, flags, fd,
+                             IORING_OFF_CQ_RING);
+    r->sqes = mmap(NULL, r->sqes_size, prot, flags, fd, IORING_OFF_SQES);
+    r->sq_ring = sq;
+    r->cq_ring = single ? NULL : cq;
+    if (sq == MAP_FAILED || cq == MAP_FAILED || r->sqes == MAP_FAILED) {
+        if (sq == MAP_FAILED) r->sq_ring = NULL;
+        if (cq == MAP_FAILED) r->cq_ring = NULL;
+        if (r->sqes == MAP_FAILED) r->sqes = NULL;
+        uring_close(r);
+        return false;
+    }
+
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return true;
+}
+
+/* Submits queued entries and, if wait is set, waits for one completion. */
+int uring_enter(Uring *r, bool wait) {
+    unsigned queued =
+        *r->sq_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    return syscall(SYS_io_uring_enter, r->fd, queued, wait ? 1 : 0,
+                   wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+/* Returns a cleared submission entry, submitting the queue first if it is
+ * full. */
+struct io_uring_sqe *uring_sqe(Uring *r) {
+    unsigned tail = *r->sq_tail;
+    while (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) ==
+           r->entries) {
+        uring_enter(r, false);
+    }
+
+    unsigned idx = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[idx] = idx;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return sqe;
+}
+
+/* user_data of a watch's poll request, and of requests whose completion is
+ * ignored. */
+#define WATCH_TAG(id, gen) ((uint64_t)(gen) << 16 | (id))
+#define IGNORE_TAG UINT64_MAX
+
+void loop_start() {
+    if (loop.started) return;
+    loop.started = true;
+
+    const char *backend = getenv("SSHELL_EVENTS");
+    bool want_uring = !backend || strcmp(backend, "poll");
+    loop.uring = want_uring && uring_setup(&loop.ring, LOOP_WATCH_MAX);
+}
+
+/* Forgets the loop in a forked child, which must not touch the parent's
+ * rings. */
+void loop_reset() {
+    if (loop.started && loop.uring) uring_close(&loop.ring);
+    memset(&loop, 0, sizeof(loop));
+}
+
+/* Watches fd until it is removed. loop_wait() returns data whenever fd is
+ * ready for events (POLLIN or POLLOUT). Returns the watch id, or -1 if all
+ * slots are in use. */
+int loop_add(int fd, short events, void *data) {
+    loop_start();
+    for (int id = 0; id < LOOP_WATCH_MAX; id++) {
+        Watch *w = &loop.watches[id];
+        if (w->active || w->armed) continue;
+        w->fd = fd;
+        w->events = events;
+        w->data = data;
+        w->active = true;
+        return id;
+    }
+    return -1;
+}
+
+/* Stops watching. A poll request still in flight is cancelled, and the
+ * slot is reused once its completion has come back. */
+void loop_remove(int id) {
+    if (id < 0) return;
+    Watch *w = &loop.watches[id];
+    w->active = false;
+    if (!w->armed) return;
+
+    struct io_uring_sqe *sqe = uring_sqe(&loop.ring);
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->addr = WATCH_TAG(id, w->gen);
+    sqe->user_data = IGNORE_TAG;
+}
+
+/* Waits until at least one watched descriptor is ready and stores the
+ * data of each that is in ready. Returns their number, or -1 on error. */
+int loop_wait(void **ready) {
+    loop_start();
+    int n = 0;
+
+    if (!loop.uring) {
+        struct pollfd fds[LOOP_WATCH_MAX];
+        int ids[LOOP_WATCH_MAX], nfds = 0;
+        for (int id = 0; id < LOOP_WATCH_MAX; id++) {
+            if (!loop.watches[id].active) continue;
+            Watch *w = &loop.watches[id];
+            fds[nfds] = (struct pollfd){w->fd, w->events, 0};
+            ids[nfds++] = id;
+        }
+        while (poll(fds, nfds, -1) == -1) {
+            if (errno != EINTR) return -1;
+        }
+        for (int i = 0; i < nfds; i++) {
+            if (fds[i].revents) ready[n++] = loop.watches[ids[i]].data;
+        }
+        return n;
+    }
+
+    /* Polls are one-shot: re-arm every watch whose last one fired. */
+    for (int id = 0; id < LOOP_WATCH_MAX; id++) {
+        Watch *w = &loop.watches[id];
+        if (!w->active || w->armed) continue;
+        struct io_uring_sqe *sqe = uring_sqe(&loop.ring);
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = w->fd;
+        sqe->poll32_events = w->events;
+        sqe->user_data = WATCH_TAG(id, ++w->gen);
+        w->armed = true;
+    }
+
+    /* Completions of cancelled polls alone don't count as an event. */
+    while (!n) {
+        if (uring_enter(&loop.ring, true) == -1 && errno != EINTR) return -1;
+
+        Uring *r = &loop.ring;
+        unsigned head = *r->cq_head;
+        unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+            if (cqe->user_data == IGNORE_TAG) continue;
+
+            Watch *w = &loop.watches[cqe->user_data & 0xffff];
+            if (cqe->user_data >> 16 != w->gen) continue;
+            w->armed = false;
+            if (w->active && cqe->res >= 0) ready[n++] = w->data;
+        }
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return n;
+}
+
+/* Returns a timerfd that fires after ms and then every interval_ms, or -1. */
+int start_timer(long ms, long interval_ms) {
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (fd == -1) return -1;
+    struct itimerspec spec = {
+        .it_interval = {interval_ms / 1000, (interval_ms % 1000) * 1000000},
+        .it_value = {ms / 1000, (ms % 1000) * 1000000},
+    };
+    timerfd_settime(fd, 0, &spec, NULL);
+    return fd;
+}
+
+/* Stops a timer started with start_timer() and watched with id. */
+void stop_timer(int *fd, int *id) {
+    if (*fd == -1) return;
+    loop_remove(*id);
+    close(*fd);
+    *fd = *id = -1;
+}
+
+/* Sets a reaped stage's exit value from its wait status and counts it. A
+ * stage killed by a signal gets 128 plus the signal number, as in other
+ * shells. pipe-split workers count through their stage instead. */
+void record_exit(Process *p, int status) {
+    if (p->split) {
+        p->exit_val = WIFSIGNALED(status) ? 128 + WTERMSIG(status)
+                                          : WEXITSTATUS(status);
+        return;
+    }
+    stats.stages++;
+    if (WIFSIGNALED(status)) {
+        int sig = WTERMSIG(status);
+        p->exit_val = 128 + sig;
+        stats.signaled++;
+        if (sig < NSIG) stats.by_signal[sig]++;
+        if (WCOREDUMP(status)) stats.core_dumps++;
+    } else {
+        p->exit_val = WEXITSTATUS(status);
+        if (p->exit_val) stats.failed++;
+    }
+}
+
+/* Makes pgrp the terminal's foreground process group. SIGTTOU is blocked
+ * since the caller may be in a background group itself. */
+void set_foreground(pid_t pgrp) {
+    sigset_t ttou, old;
+    sigemptyset(&ttou);
+    sigaddset(&ttou, SIGTTOU);
+    sigprocmask(SIG_BLOCK, &ttou, &old);
+    tcsetpgrp(STDIN_FILENO, pgrp);
+    sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
+/* Whether a finished stage should cancel the rest of its pipeline. A stage
+ * killed by SIGPIPE only means a later one stopped reading. A pipe-split
+ * worker's failure only shows in its stage's status once all are done. */
+bool stage_failed(const Process *p) {
+    if (!p->exit_val || p->split) return false;
+    return !WIFSIGNALED(p->wait_status) || WTERMSIG(p->wait_status) != SIGPIPE;
+}
+
+/* Sets up p to run its builtin b as a coroutine, on the shell's own copies
+ * of the stage's fds. Runs after every stage has forked, so no child holds
+ * those copies. Returns false if the output file can't be opened. */
+bool start_builtin(Process *p, const Builtin *b) {
+    BuiltinIO *io = calloc(1, sizeof(BuiltinIO));
+    io->builtin = b;
+    io->argv = p->argv;
+    io->stage = p;
+    io->watch = -1;
+
+    int in = (p->here_fd != -1) ? p->here_fd : p->in;
+    io->in = fcntl(in, F_DUPFD_CLOEXEC, 3);
+    io->in_nonblock = in != STDIN_FILENO;
+
+    if (p->redirect_output != NO_REDIRECT) {
+        int mode = (p->redirect_output == REDIRECT_APPEND) ? O_APPEND : O_TRUNC;
+        io->out =
+            open(p->output_path, O_WRONLY | O_CREAT | mode | O_CLOEXEC, 0644);
+        io->out_nonblock = true;
+    } else {
+        io->out = fcntl(p->out, F_DUPFD_CLOEXEC, 3);
+        io->out_nonblock = p->out != STDOUT_FILENO;
+    }
+
+    io->buf = (io->out != -1) ? io_buffer() : NULL;
+    if (!io->buf) {
+        close(io->in);
+        if (io->out != -1) close(io->out);
+        free(io);
+        return false;
+    }
+    struct stat st;
+    io->out_splice = options.splice && !fstat(io->out, &st) &&
+                     S_ISFIFO(st.st_mode);
+    if (io->in_nonblock) fcntl(io->in, F_SETFL, O_NONBLOCK);
+    if (io->out_nonblock) fcntl(io->out, F_SETFL, O_NONBLOCK);
+    p->builtin = io;
+
+    /* With `set -o threads`, run it on a worker if one is free. */
+    if (options.threads) {
+        io->wake_fd = eventfd(0, EFD_CLOEXEC);
+        io->done_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        io->threaded = io->wake_fd != -1 && io->done_fd != -1;
+        if (io->threaded && pool_submit(io)) return true;
+        io->threaded = false;
+        if (io->wake_fd != -1) close(io->wake_fd);
+        if (io->done_fd != -1) close(io->done_fd);
+    }
+
+    if (!co_init(&io->co, builtin_entry)) {
+        close(io->in);
+        close(io->out);
+        munmap(io->buf, BUILTIN_BUF_SIZE);
+        free(io);
+        p->builtin = NULL;
+        return false;
+    }
+    return true;
+}
+
+/* Sets a finished builtin's status and releases its stack and fds. Closing
+ * them is what lets the stages next to it see end of file or EPIPE. */
+void finish_builtin(Process *p) {
+    BuiltinIO *io = p->builtin;
+    int status = io->status << 8;
+    if (io->cancel)
+        status = io->cancel;
+    else if (io->broken_pipe)
+        status = SIGPIPE;
+    p->wait_status = status;
+    record_exit(p, status);
+
+    loop_remove(io->watch);
+    close(io->in);
+    close(io->out);
+    for (int i = 0; i < p->num_substs; i++) close(p->subst_fds[i]);
+    if (io->threaded) {
+        close(io->wake_fd);
+        close(io->done_fd);
+    } else {
+        co_free(&io->co);
+    }
+    munmap(io->buf, BUILTIN_BUF_SIZE);
+    if (io->spare) munmap(io->spare, BUILTIN_BUF_SIZE);
+    free(io);
+    p->builtin = NULL;
+}
+
+/* Runs a builtin until it has to wait, and watches what it waits for.
+ * Returns true once it has finished. */
+bool step_builtin(Process *p) {
+    BuiltinIO *io = p->builtin;
+
+    /* A worker's builtin is done once done_fd is readable; until then the
+     * reaper waits on that like on a pidfd. */
+    if (io->threaded) {
+        uint64_t n;
+        if (read(io->done_fd, &n, sizeof(n)) == sizeof(n)) {
+            finish_builtin(p);
+            return true;
+        }
+        if (io->cancel) eventfd_signal(io->wake_fd);
+        if (io->watch == -1) io->watch = loop_add(io->done_fd, POLLIN, p);
+        return false;
+    }
+
+    while (1) {
+        loop_remove(io->watch);
+        io->watch = -1;
+        starting_builtin = io;
+        co_resume(&io->co);
+        if (io->co.done) {
+            finish_builtin(p);
+            return true;
+        }
+
+        io->watch = loop_add(io->wait_fd, io->wait_events, p);
+        if (io->watch != -1) return false;
+
+        /* No slot left to wait in. */
+        io->cancel = SIGKILL;
+    }
+}
+
+/* Reaps one stage, whose pidfd has become readable, and stops watching it. */
+void reap_stage(Process *p) {
+    int status;
+    wait4(p->pid, &status, 0, &p->rusage);
+    p->wait_status = status;
+    record_exit(p, status);
+    loop_remove(p->watch);
+    close(p->pidfd);
+    p->pidfd = p->watch = -1;
+}
+
+/* Opens a pidfd for every forked stage and watches it. Returns false, having
+ * undone everything, if any of that fails (pidfds need Linux 5.3). */
+bool watch_stages(Process *head) {
+    bool ok = true;
+    for (Process *cur = head; cur; cur = cur->next) {
+        cur->pidfd = cur->watch = -1;
+        if (cur->pid <= 0 || !ok) continue;
+        cur->pidfd = syscall(SYS_pidfd_open, cur->pid, 0);
+        if (cur->pidfd != -1) cur->watch = loop_add(cur->pidfd, POLLIN, cur);
+        ok = cur->watch != -1;
+    }
+    if (ok) return true;
+
+    for (Process *cur = head; cur; cur = cur->next) {
+        loop_remove(cur->watch);
+        if (cur->pidfd != -1) close(cur->pidfd);
+        cur->pidfd = cur->watch = -1;
+    }
+    return false;
+}
+
+/* Sends sig to the stages still running: to the process group if there is
+ * one, otherwise through each pidfd. Builtins are stopped as if by sig.
+ * Returns the number of builtins that finished. */
+int signal_stages(Process *head, pid_t pgid, int sig) {
+    if (pgid) kill(-pgid, sig);
+
+    int finished = 0;
+    for (Process *cur = head; cur; cur = cur->next) {
+        if (cur->builtin) {
+            __atomic_store_n(&cur->builtin->cancel, sig, __ATOMIC_RELEASE);
+            finished += step_builtin(cur);
+        } else if (cur->pidfd != -1 && !pgid) {
+            syscall(SYS_pidfd_send_signal, cur->pidfd, sig, NULL, 0);
+        }
+    }
+    return finished;
+}
+
+/* Waits for whichever stage finishes first without pidfds. Returns it, or
+ * NULL if there was nothing to wait for. */
+Process *wait_any_stage(Process *head) {
+    while (1) {
+        int status;
+        struct rusage usage;
+        pid_t pid = wait4(-1, &status, 0, &usage);
+        if (pid == -1) {
+            if (errno == EINTR) continue;
+            return NULL;
+        }
+
+        /* Substitution subshells can finish here too. */
+        Process *p = head;
+        while (p && p->pid != pid) p = p->next;
+        if (!p) continue;
+
+        p->wait_status = status;
+        p->rusage = usage;
+        record_exit(p, status);
+        return p;
+    }
+}
+
+/* Runs the builtins and reaps the forked stages of a pipeline in the order
+ * they finish, waiting on the builtins' fds and the stages' pidfds through
+ * the event loop together with the timeout and the batched records' flush
+ * timer. With failfast, the first failing stage terminates the rest. */
+void reap_processes(Process *head, pid_t pgid) {
+    int running = 0, builtins = 0;
+    bool cancel = false, cancelled = false;
+    for (Process *cur = head; cur; cur = cur->next) {
+        if (cur->pid > 0)
+            running++;
+        else if (!cur->builtin && stage_failed(cur))
+            cancel = true;
+    }
+    bool events = running && watch_stages(head);
+
+    /* Builtins run until they first have to wait. */
+    for (Process *cur = head; cur; cur = cur->next) {
+        if (!cur->builtin) continue;
+        if (step_builtin(cur))
+            cancel |= stage_failed(cur);
+        else
+            running++, builtins++;
+    }
+
+    int timeout = -1, timeout_id = -1, expired = 0;
+    if (events && options.timeout) {
+        timeout = start_timer(options.timeout * 1000L, KILL_GRACE_MS);
+        if (timeout != -1) timeout_id = loop_add(timeout, POLLIN, &timeout);
+    }
+
+    /* Records batched before this pipeline shouldn't wait for it to end. */
+    int flush = -1, flush_id = -1;
+    if (events && reporter.batch && reporter.len) {
+        long age_ms = elapsed_ns(&reporter.oldest) / 1000000;
+        long delay = REPORT_FLUSH_MS - age_ms;
+        flush = start_timer(delay > 0 ? delay : 1, 0);
+        if (flush != -1) flush_id = loop_add(flush, POLLIN, &flush);
+    }
+
+    while (running) {
+        if (cancel && options.failfast && !cancelled) {
+            int stopped = signal_stages(head, pgid, SIGTERM);
+            running -= stopped;
+            builtins -= stopped;
+            stats.cancelled++;
+            cancelled = true;
+            if (!running) break;
+        }
+
+        void *ready[LOOP_WATCH_MAX];
+        int n = 0;
+        if (events || builtins) {
+            n = loop_wait(ready);
+        } else {
+            ready[0] = wait_any_stage(head);
+            n = ready[0] ? 1 : -1;
+        }
+        if (n == -1) break;
+
+        for (int i = 0; i < n; i++) {
+            uint64_t ticks;
+            if (ready[i] == &timeout) {
+                /* SIGTERM first, then SIGKILL every KILL_GRACE_MS. */
+                read(timeout, &ticks, sizeof(ticks));
+                if (!expired++) stats.timed_out++;
+                int stopped = signal_stages(head, pgid,
+                                            expired == 1 ? SIGTERM : SIGKILL);
+                running -= stopped;
+                builtins -= stopped;
+            } else if (ready[i] == &flush) {
+                report_flush();
+                stop_timer(&flush, &flush_id);
+            } else {
+                Process *p = ready[i];
+                if (p->builtin) {
+                    if (!step_builtin(p)) continue;
+                    builtins--;
+                } else if (p->pid <= 0) {
+                    /* A builtin stopped earlier in this batch. */
+                    continue;
+                } else if (events) {
+                    reap_stage(p);
+                }
+                running--;
+                if (stage_failed(p)) cancel = true;
+            }
+        }
+    }
+
+    stop_timer(&timeout, &timeout_id);
+    stop_timer(&flush, &flush_id);
+}
+
+/* Adds the workers of each pipe-split stage to the pipeline right before
+ * it, each with a pipe from the shell as its stdin and one back as its
+ * stdout, so they launch and get reaped like any other stage. They report
+ * only through the pipe-split stage's status, though. The
+ * stage's exec_path, unused by a builtin, is set to the command's, which is
+ * all pmap and pipe-split -k need for the jobs they start themselves. */
+void split_stages(Pipeline *pl) {
+    Process **link = &pl->head;
+    for (Process *cur = pl->head; cur; link = &cur->next, cur = cur->next) {
+        const Builtin *b = cur->cmd ? find_shell_builtin(cur->argv) : NULL;
+        if (!b || (b->run != builtin_pipe_split && b->run != builtin_pmap))
+            continue;
+
+        int argc = 0;
+        while (cur->argv[argc]) argc++;
+        SplitOptions o;
+        if (!split_args(argc, cur->argv, &o)) continue;
+        if (!single_line && !is_builtin(o.cmd[0]))
+            cur->exec_path = find_command(o.cmd[0]);
+        if (o.keep_order) continue;
+
+        for (int i = 0; i < o.jobs; i++) {
+            int to[2], from[2];
+            if (pipe2(to, O_CLOEXEC) == -1) break;
+            if (pipe2(from, O_CLOEXEC) == -1) {
+                close(to[0]);
+                close(to[1]);
+                break;
+            }
+            fcntl(to[1], F_SETFL, O_NONBLOCK);
+            fcntl(from[0], F_SETFL, O_NONBLOCK);
+
+            Process *w = (Process *)calloc(1, sizeof(Process));
+            w->pid = -1;
+            w->in = to[0];
+            w->out = from[1];
+            w->feed_fd = to[1];
+            w->drain_fd = from[0];
+            w->redirect_output = NO_REDIRECT;
+            w->here_type = NO_HERE;
+            w->here_fd = -1;
+            w->argv = o.cmd;
+            w->cmd = o.cmd[0];
+            w->exec_path = cur->exec_path;
+            w->split = cur;
+
+            w->next = cur;
+            *link = w;
+            link = &w->next;
+            if (!cur->workers) cur->workers = w;
+            cur->num_workers++;
+        }
+    }
+}
+
+void run_processes(Pipeline *pl) {
+    Process *head = pl->head;
+    Process *cur = head;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    /* With failfast the pipeline gets its own process group, which also
+     * takes over the terminal while it runs if the shell has it. */
+    bool group = options.failfast;
+    bool terminal = group && isatty(STDIN_FILENO) &&
+                    tcgetpgrp(STDIN_FILENO) == getpgrp();
+    pid_t pgid = 0;
+
+    /* Expand right before launch so earlier commands (e.g. cd) are seen, but
+     * before creating pipes so substitution subshells don't hold them. */
+    for (; cur; cur = cur->next) {
+        cur->pid = -1;
+        bool ok = expand_process(cur);
+        if (ok && cur->here_type != NO_HERE && !open_here_input(cur)) {
+            handle_error(LAUNCH_ERR_HERE_INPUT);
+            ok = false;
+        }
+        if (!ok) {
+            /* Don't launch it. */
+            cur->cmd = NULL;
+            cur->exit_val = 1;
+        } else if (cur->cmd && !single_line && !is_builtin(cur->cmd)) {
+            cur->exec_path = find_command(cur->cmd);
+        }
+    }
+
+    create_pipes(head);
+    split_stages(pl);
+    head = pl->head;
+    for (cur = head; cur; cur = cur->next) {
+        char *cmd = cur->cmd;
+
+        /* Still in parent process... */
+        if (!cmd) {
+            /* Every word expanded to nothing: nothing to run. */
+        } else if (!strcmp(cmd, "exit")) {
+            /* A subshell ends as if its list had run out: see
+             * fork_subshell(). */
+            if (in_subshell) {
+                fflush(stdout);
+                _exit(last_status);
+            }
+            fprintf(stderr, "Bye...\n");
+            pl->wall_ns = elapsed_ns(&start);
+            print_result(pl);
+            report_flush();
+            exit(EXIT_SUCCESS);
+        } else if (!strcmp(cmd, "set") && cur->argv[1]) {
+            if (!set_option(cur->argv)) {
+                handle_error(LAUNCH_ERR_BAD_OPTION);
+                cur->exit_val = 1;
+            }
+        } else if (!strcmp(cmd, "cd")) {
+            char *dir_name = cur->argv[1];
+
+            /* No need to call exit from here because we're still in the parent
+             * process. */
+            if (!dir_name || chdir(dir_name) == -1) {
+                handle_error(LAUNCH_ERR_ACCESS_DIR);
+                cur->exit_val = 1;
+            }
+        }
+
+        else if ((cur->shell_builtin = find_shell_builtin(cur->argv))) {
+            /* Runs inside the shell, started below. */
+        }
+
+        /* Forking */
+        else if (!(cur->pid = fork())) {
+            if (group) {
+                setpgid(0, pgid);
+                if (terminal) set_foreground(getpgrp());
+            }
+            exec_stage(cur, head);
+        } else if (cur->pid > 0 && group) {
+            /* Also set here so the group exists before the parent relies on
+             * it, whichever process runs first. */
+            if (!pgid) pgid = cur->pid;
+            setpgid(cur->pid, pgid);
+            if (terminal && pgid == cur->pid) set_foreground(pgid);
+        }
+    }
+
+    /* Builtins get their own copies of their fds only now, so that no child
+     * holds them. */
+    for (cur = head; cur; cur = cur->next) {
+        if (cur->shell_builtin && !start_builtin(cur, cur->shell_builtin)) {
+            handle_error(LAUNCH_ERR_ACCESS_FILE);
+            cur->exit_val = 1;
+            close_workers(cur);
+        }
+    }
+
+    close_pipes(head);
+    close_substitutions(head);
+
+    /* Only processes that forked have a pid (not exit or cd). */
+    reap_processes(head, pgid);
+    if (terminal) set_foreground(getpgrp());
+
+    /* Substitutions finish once the processes using them are gone. */
+    for (cur = head; cur; cur = cur->next) {
+        for (int i = 0; i < cur->num_substs; i++)
+            waitpid(cur->subst_pids[i], NULL, 0);
+    }
+
+    /* A pipe-split stage reports for its workers: its status is its own
+     * failure, or else the first of theirs, as with its -k jobs. */
+    for (cur = head; cur; cur = cur->next) {
+        if (cur->split && !cur->split->exit_val)
+            cur->split->exit_val = cur->exit_val;
+    }
+
+    /* A pipeline's status is the exit value of its last process, or with
+     * pipefail of the last one that failed. */
+    pl->status = 0;
+    for (cur = head; cur; cur = cur->next) {
+        if (cur->split) continue;
+        if (!options.pipefail || cur->exit_val) pl->status = cur->exit_val;
+    }
+    pl->wall_ns = elapsed_ns(&start);
+    stats.pipelines++;
+
+    print_result(pl);
+}
+
+void free_processes(Process *head) {
+    Process *cur = head;
+    while (cur != NULL) {
+        Process *next = cur->next;
+        free(cur);
+        cur = next;
+    }
+}
+
+/* Lexes and parses a whole command line into a list of pipelines. Returns a
+ * parse error (and no list) if the line is invalid. Modifies original
+ * string. */
+ErrorType parse_command_list(char *input, Pipeline **list) {
+    Token tokens[CMDLINE_MAX + 1];
+    size_t len = strlen(input);
+    Pipeline *head = NULL;
+    Pipeline *cur = NULL;
+
+    *list = NULL;
+
+    /* Keep the line as typed for completion messages, since lexing modifies
+     * it. */
+    char *orig = arena_strndup(&cmd_arena, input, len);
+    unsigned char *mask = (unsigned char *)arena_alloc(&cmd_arena, len + 1);
+
+    ErrorType e = lex_line(input, mask, tokens);
+    if (e == NO_ERROR) e = parse_errors(tokens);
+    if (e != NO_ERROR) return e;
+
+    Token *t = tokens;
+    while (t->type != TOK_END) {
+        Pipeline *next = (Pipeline *)malloc(sizeof(Pipeline));
+        Token *first = t;
+
+        next->head = initialize_processes(&t);
+        next->cmdline = arena_strndup(&cmd_arena, orig + first->start,
+                                      t[-1].end - first->start);
+        next->op = (t->type == TOK_AND)  ? LIST_AND
+                   : (t->type == TOK_OR) ? LIST_OR
+                                         : LIST_SEQ;
+        next->status = 0;
+        next->next = NULL;
+
+        if (!head)
+            head = next;
+        else
+            cur->next = next;
+        cur = next;
+
+        if (t->type != TOK_END) t++;
+    }
+
+    *list = head;
+    return NO_ERROR;
+}
+
+/* Runs every pipeline of a command list in order, skipping pipelines whose
+ * `&&`/`||` condition does not hold. */
+void run_command_list(Pipeline *head) {
+    Pipeline *cur = head;
+    ListOp prev_op = LIST_SEQ;
+    int status = 0;
+
+    /* PATH directories may have changed since the last command line. */
+    if (path_cache.snapshot) path_cache_check();
+
+    while (cur) {
+        bool skip = (prev_op == LIST_AND && status != 0) ||
+                    (prev_op == LIST_OR && status == 0);
+        if (!skip) {
+            run_processes(cur);
+            status = last_status = cur->status;
+        }
+        prev_op = cur->op;
+        cur = cur->next;
+    }
+}
+
+void free_command_list(Pipeline *head) {
+    Pipeline *cur = head;
+    while (cur != NULL) {
+        Pipeline *next = cur->next;
+        free_processes(cur->head);
+        free(cur);
+        cur = next;
+    }
+}
+
+/* Forks a copy of the shell that runs list with fd as its target_fd (stdout
+ * or stdin) and exits with the list's status. The copy doesn't hold the other
+ * process substitutions of p (if any) open. */
+pid_t fork_subshell(Pipeline *list, int fd, int target_fd, Process *p) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(fd, target_fd);
+        close(fd);
+        for (int i = 0; p && i < p->num_substs; i++) close(p->subst_fds[i]);
+
+        /* Batched records belong to the parent. */
+        in_subshell = true;
+        reporter.len = 0;
+        loop_reset();
+        pool_reset();
+        run_command_list(list);
+
+        /* Not exit(): see the forked stages in run_processes(). */
+        fflush(stdout);
+        _exit(last_status);
+    }
+    return pid;
+}
+
+/* Implements <(cmd) and >(cmd): a forked copy of the shell runs the inner
+ * command list with its stdout (or stdin) on a pipe, and the other end is
+ * passed to the process as /dev/fd/N. Returns that path, or NULL if the inner
+ * command line is invalid. */
+char *process_substitution(const Word *w, Process *p) {
+    size_t len = strlen(w->text);
+    char *inner_line = arena_strndup(&cmd_arena, w->text, len);
+    Pipeline *inner;
+    ErrorType e = parse_command_list(inner_line, &inner);
+    if (e != NO_ERROR) {
+        handle_error(e);
+        return NULL;
+    }
+
+    /* fd[0] is read by the process for <(cmd), fd[1] written for >(cmd). */
+    int fd[2];
+    if (pipe2(fd, O_CLOEXEC) == -1) {
+        free_command_list(inner);
+        return NULL;
+    }
+    bool reads = (w->kind == WORD_PROC_IN);
+    int keep = reads ? fd[0] : fd[1];
+    int give = reads ? fd[1] : fd[0];
+
+    /* Registered first so the subshell closes the shell's end too. */
+    int i = p->num_substs++;
+    p->subst_fds[i] = keep;
+    p->subst_pids[i] = fork_subshell(
+        inner, give, reads ? STDOUT_FILENO : STDIN_FILENO, p);
+    close(give);
+    free_command_list(inner);
+
+    char path[32];
+    snprintf(path, sizeof(path), "/dev/fd/%d", keep);
+    return arena_strndup(&cmd_arena, path, strlen(path));
+}
+
+/* Implements $(cmd): a forked copy of the shell runs the inner command line
+ * with its stdout on a pipe, and the output is appended to b without its
+ * trailing newlines. Whitespace in the output is marked for field splitting
+ * if split is set. Outputs up to CAPTURE_INLINE bytes are captured on the
+ * stack; larger ones grow a buffer in the command arena. */
+bool command_substitution(const char *body, size_t len, WordBuf *b,
+                          bool split) {
+    char *inner_line = arena_strndup(&cmd_arena, body, len);
+    Pipeline *inner;
+    ErrorType e = parse_command_list(inner_line, &inner);
+    if (e != NO_ERROR) {
+        handle_error(e);
+        return false;
+    }
+
+    int fd[2];
+    if (pipe2(fd, O_CLOEXEC) == -1) {
+        free_command_list(inner);
+        return false;
+    }
+    pid_t pid = fork_subshell(inner, fd[1], STDOUT_FILENO, NULL);
+    close(fd[1]);
+    free_command_list(inner);
+
+    char small[CAPTURE_INLINE];
+    char *buf = small;
+    size_t cap = sizeof(small), used = 0;
+    while (1) {
+        if (used == cap) {
+            char *bigger = (char *)arena_alloc(&cmd_arena, cap * 2);
+            memcpy(bigger, buf, used);
+            buf = bigger;
+            cap *= 2;
+        }
+        ssize_t n = read(fd[0], buf + used, cap - used);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) break;
+        used += n;
+    }
+    close(fd[0]);
+    if (pid > 0) waitpid(pid, NULL, 0);
+
+    while (used > 0 && buf[used - 1] == '\n') used--;
+    for (size_t i = 0; i < used; i++) {
+        bool space = split && isspace((unsigned char)buf[i]);
+        word_buf_putc(b, buf[i], space ? (QUOTE_SINGLE | FIELD_SPLIT)
+                                       : QUOTE_SINGLE);
+    }
+    return true;
+}
+
+/* Builds the suffix array of text by prefix doubling, radix sorting on
+ * (rank of i, rank of i + k) pairs each round. Suffixes only need to be
+ * ordered by their first depth bytes, which saves rounds on repetitive
+ * text. Returns false if memory runs out. */
+bool build_suffix_array(const unsigned char *text, uint32_t n, uint32_t depth,
+                        uint32_t *sa) {
+    uint32_t *rank = (uint32_t *)malloc(n * sizeof(uint32_t));
+    uint32_t *tmp = (uint32_t *)malloc(n * sizeof(uint32_t));
+    uint32_t *count = (uint32_t *)malloc((n > 256 ? n : 256) * sizeof(uint32_t) + 4);
+    if (!rank || !tmp || !count) {
+        free(rank);
+        free(tmp);
+        free(count);
+        return false;
+    }
+
+    /* Round 0: sort by first character. */
+    memset(count, 0, 256 * sizeof(uint32_t));
+    for (uint32_t i = 0; i < n; i++) count[text[i]]++;
+    for (uint32_t c = 1; c < 256; c++) count[c] += count[c - 1];
+    for (uint32_t i = n; i-- > 0;) sa[--count[text[i]]] = i;
+    uint32_t classes = 1;
+    rank[sa[0]] = 0;
+    for (uint32_t i = 1; i < n; i++) {
+        if (text[sa[i]] != text[sa[i - 1]]) classes++;
+        rank[sa[i]] = classes - 1;
+    }
+
+    for (uint32_t k = 1; classes < n && k < depth; k *= 2) {
+        /* Order by second key: suffixes without a second half come first. */
+        uint32_t m = 0;
+        for (uint32_t i = n - (k < n ? k : n); i < n; i++) tmp[m++] = i;
+        for (uint32_t i = 0; i < n; i++) {
+            if (sa[i] >= k) tmp[m++] = sa[i] - k;
+        }
+
+        /* Stable counting sort by first key. */
+        memset(count, 0, classes * sizeof(uint32_t));
+        for (uint32_t i = 0; i < n; i++) count[rank[i]]++;
+        for (uint32_t c = 1; c < classes; c++) count[c] += count[c - 1];
+        for (uint32_t i = n; i-- > 0;) sa[--count[rank[tmp[i]]]] = tmp[i];
+
+        /* Re-rank; tmp holds the new ranks. */
+        tmp[sa[0]] = 0;
+        classes = 1;
+        for (uint32_t i = 1; i < n; i++) {
+            uint32_t a = sa[i - 1], b = sa[i];
+            uint32_t a2 = (a + k < n) ? rank[a + k] + 1 : 0;
+            uint32_t b2 = (b + k < n) ? rank[b + k] + 1 : 0;
+            if (rank[a] != rank[b] || a2 != b2) classes++;
+            tmp[b] = classes - 1;
+        }
+        uint32_t *swap = rank;
+        rank = tmp;
+        tmp = swap;
+    }
+
+    free(rank);
+    free(tmp);
+    free(count);
+    return true;
+}
+
+/* Indexes the history file for Ctrl-R when it is loaded, so no keystroke
+ * waits for the sort. Without the index, searches scan the entries. */
+void index_history() {
+    if (history.map_len > UINT32_MAX) return;
+
+    /* Queries never span entries, so suffixes only need ordering up to the
+     * end of the longest entry. */
+    uint32_t depth = 1;
+    for (size_t i = 0; i < history.num_file; i++) {
+        size_t entry_len = history.offsets[i + 1] - history.offsets[i];
+        if (entry_len > depth) depth = entry_len;
+    }
+    history.suffixes = (uint32_t *)malloc(history.map_len * sizeof(uint32_t));
+    if (history.suffixes &&
+        !build_suffix_array((const unsigned char *)history.map,
+                            history.map_len, depth, history.suffixes)) {
+        free(history.suffixes);
+        history.suffixes = NULL;
+    }
+}
+
+/* Returns entry i of the history and its length (without the newline). */
+const char *history_entry(size_t i, size_t *len) {
+    if (i >= history.num_file) {
+        const char *s = history.session[i - history.num_file];
+        *len = strlen(s);
+        return s;
+    }
+    size_t start = history.offsets[i], end = history.offsets[i + 1];
+    if (end > start && history.map[end - 1] == '\n') end--;
+    *len = end - start;
+    return history.map + start;
+}
+
+size_t history_count() { return history.num_file + history.num_session; }
+
+/* Opens the history file and maps the entries it holds. Called on first use
+ * so non-interactive shells never touch it. */
+void history_load() {
+    if (history.loaded) return;
+    history.loaded = true;
+    history.fd = -1;
+
+    char path[PATH_MAX];
+    const char *file = getenv("SSHELL_HISTFILE");
+    const char *home = getenv("HOME");
+    if (file)
+        snprintf(path, sizeof(path), "%s", file);
+    else if (home)
+        snprintf(path, sizeof(path), "%s/%s", home, HISTORY_FILE);
+    else
+        return;
+
+    history.fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    struct stat sb;
+    if (history.fd == -1 || fstat(history.fd, &sb) == -1 || sb.st_size == 0)
+        return;
+
+    history.map_len = sb.st_size;
+    history.map = (char *)mmap(NULL, history.map_len, PROT_READ, MAP_PRIVATE,
+                               history.fd, 0);
+    if (history.map == MAP_FAILED) {
+        history.map = NULL;
+        history.map_len = 0;
+        return;
+    }
+
+    size_t cap = 1024;
+    history.offsets = (size_t *)malloc(cap * sizeof(size_t));
+    for (size_t pos = 0; pos < history.map_len;) {
+        if (history.num_file + 1 >= cap) {
+            cap *= 2;
+            history.offsets =
+                (size_t *)realloc(history.offsets, cap * sizeof(size_t));
+        }
+        history.offsets[history.num_file++] = pos;
+        char *nl = (char *)memchr(history.map + pos, '\n', history.map_len - pos);
+        pos = nl ? (size_t)(nl - history.map) + 1 : history.map_len;
+    }
+    history.offsets[history.num_file] = history.map_len;
+    index_history();
+}
+
+/* Adds a command line to the history, appending it to the history file with
+ * a single write. Repeats of the previous entry are skipped. */
+void history_add(const char *line) {
+    history_load();
+    size_t len = strlen(line), last_len;
+    size_t count = history_count();
+    if (!len) return;
+    if (count && !strcmp(history_entry(count - 1, &last_len), line)) return;
+
+    if (history.num_session == history.session_cap) {
+        history.session_cap = history.session_cap ? history.session_cap * 2 : 64;
+        history.session = (char **)realloc(
+            history.session, history.session_cap * sizeof(char *));
+    }
+    history.session[history.num_session++] = strdup(line);
+
+    if (history.fd != -1) {
+        char buf[CMDLINE_MAX + 1];
+        memcpy(buf, line, len);
+        buf[len] = '\n';
+        write(history.fd, buf, len + 1);
+    }
+}
+
+/* Returns the index of the history file entry containing byte pos. */
+size_t history_entry_at(size_t pos) {
+    size_t lo = 0, hi = history.num_file;
+    while (hi - lo > 1) {
+        size_t mid = (lo + hi) / 2;
+        if (history.offsets[mid] <= pos)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* Compares the suffix of the history file at pos with query, looking only at
+ * the first len bytes. */
+int compare_suffix(uint32_t pos, const char *query, size_t len) {
+    size_t avail = history.map_len - pos;
+    int c = memcmp(history.map + pos, query, avail < len ? avail : len);
+    if (c || avail >= len) return c;
+    return -1;
+}
+
+/* Looks up query in the suffix array, setting *match to the most recent
+ * file entry before entry `before` that contains it, or -1. Returns false
+ * if there is no index, or if the matches are too many to sort through and
+ * a scan is quicker. */
+bool search_suffixes(const char *query, size_t len, size_t before,
+                     long *match) {
+    if (!history.suffixes) return false;
+
+    /* Suffixes starting with the query form one range of the suffix
+     * array. */
+    size_t lo = 0, hi = history.map_len;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (compare_suffix(history.suffixes[mid], query, len) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    size_t first = lo;
+    hi = history.map_len;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (compare_suffix(history.suffixes[mid], query, len) <= 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (lo - first <= SEARCH_RANGE_MAX) {
+        /* Entries are in file order, so the newest match is the one with the
+         * last position before entry `before`. */
+        size_t limit = history.offsets[before];
+        size_t best = 0;
+        bool found = false;
+        for (size_t i = first; i < lo; i++) {
+            size_t pos = history.suffixes[i];
+            if (pos < limit && (!found || pos > best)) {
+                best = pos;
+                found = true;
+            }
+        }
+        *match = found ? (long)history_entry_at(best) : -1;
+        return true;
+    }
+    return false;
+}
+
+/* Finds the most recent history entry before entry `before` that contains
+ * query. Returns -1 if there is none. */
+long history_search(const char *query, size_t len, size_t before) {
+    size_t count = history_count();
+    if (before > count) before = count;
+
+    /* Entries added this session aren't indexed and are few: scan them. */
+    for (size_t i = before; i-- > history.num_file;) {
+        size_t entry_len;
+        const char *entry = history_entry(i, &entry_len);
+        if (memmem(entry, entry_len, query, len)) return i;
+    }
+    if (before > history.num_file) before = history.num_file;
+    if (!before) return -1;
+    if (!len) return before - 1;
+
+    long match;
+    if (search_suffixes(query, len, before, &match)) return match;
+
+    /* Dense matches, or no index: scanning back from the newest entry
+     * finds one quickly enough. */
+    for (size_t i = before; i-- > 0;) {
+        size_t entry_len;
+        const char *entry = history_entry(i, &entry_len);
+        if (memmem(entry, entry_len, query, len)) return i;
+    }
+    return -1;
+}
+
+/* Puts the terminal in raw mode for line editing. Returns false if stdin is
+ * not a terminal. */
+bool enable_raw_mode(struct termios *orig) {
+    if (tcgetattr(STDIN_FILENO, orig) == -1) return false;
+    struct termios raw = *orig;
+    raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+    raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    return tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) != -1;
+}
+
+/* Redraws the prompt and line with a single write, leaving the cursor at
+ * pos. During a search, shows the query and the match instead. */
+void refresh_line(const LineEditor *ed) {
+    char buf[CMDLINE_MAX * 3 + 64];
+    int n;
+    if (ed->searching) {
+        n = snprintf(buf, sizeof(buf), "\r(%sreverse-i-search)`%s': %s\x1b[K",
+                     ed->search_failed ? "failed " : "", ed->query, ed->buf);
+    } else {
+        n = snprintf(buf, sizeof(buf), "\r%s%s\x1b[K\r", PROMPT, ed->buf);
+        size_t col = strlen(PROMPT) + ed->pos;
+        if (col) n += snprintf(buf + n, sizeof(buf) - n, "\x1b[%zuC", col);
+    }
+    write(STDOUT_FILENO, buf, n);
+}
+
+/* Replaces the line with history entry i (or the line being typed if i is
+ * the end of the history). */
+void load_history_line(LineEditor *ed, size_t i) {
+    size_t len;
+    const char *text =
+        (i < history_count()) ? history_entry(i, &len) : ed->saved;
+    if (i >= history_count()) len = strlen(text);
+    if (len >= CMDLINE_MAX) len = CMDLINE_MAX - 1;
+    memmove(ed->buf, text, len);
+    ed->buf[len] = '\0';
+    ed->len = ed->pos = len;
+    ed->hist_pos = i;
+}
+
+/* Runs one incremental search step: finds the newest entry older than
+ * `before` matching the query and shows it. */
+void search_step(LineEditor *ed, size_t before) {
+    long found = history_search(ed->query, ed->query_len, before);
+    ed->search_failed = (found == -1);
+    if (found != -1) {
+        load_history_line(ed, found);
+        size_t len;
+        const char *entry = history_entry(found, &len);
+        const char *match = (const char *)memmem(entry, len, ed->query,
+                                                 ed->query_len);
+        ed->pos = match ? (size_t)(match - entry) : 0;
+        if (ed->pos > ed->len) ed->pos = ed->len;
+    }
+}
+
+/* Reads the rest of an escape sequence and maps it to a key. */
+int read_escape(void) {
+    char seq[3];
+    if (read(STDIN_FILENO, &seq[0], 1) != 1) return KEY_ESC;
+    if (read(STDIN_FILENO, &seq[1], 1) != 1) return KEY_ESC;
+
+    if (seq[0] == '[' && isdigit((unsigned char)seq[1])) {
+        if (read(STDIN_FILENO, &seq[2], 1) != 1 || seq[2] != '~') return KEY_ESC;
+        switch (seq[1]) {
+            case '1':
+            case '7':
+                return KEY_HOME;
+            case '3':
+                return KEY_DELETE;
+            case '4':
+            case '8':
+                return KEY_END;
+        }
+        return KEY_ESC;
+    }
+    if (seq[0] == '[' || seq[0] == 'O') {
+        switch (seq[1]) {
+            case 'A':
+                return KEY_UP;
+            case 'B':
+                return KEY_DOWN;
+            case 'C':
+                return KEY_RIGHT;
+            case 'D':
+                return KEY_LEFT;
+            case 'H':
+                return KEY_HOME;
+            case 'F':
+                return KEY_END;
+        }
+    }
+    return KEY_ESC;
+}
+
+/* Inserts c at the cursor if the line has room. */
+void insert_char(LineEditor *ed, char c) {
+    if (ed->len >= CMDLINE_MAX - 1) return;
+    memmove(ed->buf + ed->pos + 1, ed->buf + ed->pos, ed->len - ed->pos + 1);
+    ed->buf[ed->pos++] = c;
+    ed->len++;
+}
+
+/* Inserts completed text at the cursor, escaping characters the lexer would
+ * otherwise treat specially. */
+void insert_escaped(LineEditor *ed, const char *s, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        if (strchr(" \t|&;<>()$'\"\\*?[", s[i])) {
+            if (ed->len + 2 > CMDLINE_MAX - 1) return;
+            insert_char(ed, '\\');
+        }
+        insert_char(ed, s[i]);
+    }
+}
+
+/* Appends names in the trie below node to out, in sorted order. name holds
+ * the len characters leading to node. Stops after COMPLETION_LIST_MAX + 1
+ * names, enough to tell there are more. */
+void trie_collect(int node, char *name, size_t len, ArgVec *out) {
+    if (out->len > COMPLETION_LIST_MAX) return;
+    if (path_cache.nodes[node].dir != -1)
+        argvec_push(out, arena_strndup(&cmd_arena, name, len));
+    if (len + 1 >= PATH_MAX) return;
+    for (int c = path_cache.nodes[node].child; c != -1;
+         c = path_cache.nodes[c].sibling) {
+        name[len] = path_cache.nodes[c].c;
+        trie_collect(c, name, len + 1, out);
+    }
+}
+
+/* Completes a command name from the trie of builtins and PATH executables.
+ * Only walks the nodes below the prefix, so the cost doesn't depend on how
+ * many executables there are. */
+void complete_command(const char *word, size_t n, bool list, Completion *c) {
+    path_cache_check();
+    path_trie_build();
+    int node = trie_find(word, n);
+    if (node == -1) return;
+
+    /* Follow the chain of single children: that part is common to every
+     * candidate. */
+    TrieNode *nodes = path_cache.nodes;
+    char *name = (char *)arena_alloc(&cmd_arena, PATH_MAX);
+    size_t len = n;
+    memcpy(name, word, n);
+    while (nodes[node].dir == -1 && nodes[node].child != -1 &&
+           nodes[nodes[node].child].sibling == -1 && len < PATH_MAX - 1) {
+        node = nodes[node].child;
+        name[len++] = nodes[node].c;
+    }
+    c->common = name;
+    c->common_len = len;
+    c->count = (nodes[node].dir != -1 && nodes[node].child == -1) ? 1 : 2;
+
+    if (list && c->count > 1) {
+        char *path = (char *)arena_alloc(&cmd_arena, PATH_MAX);
+        memcpy(path, name, len);
+        trie_collect(node, path, len, &c->names);
+        c->more = c->names.len > COMPLETION_LIST_MAX;
+        if (c->more) c->names.len = COMPLETION_LIST_MAX;
+    }
+}
+
+/* Completes a file name from the sorted index of its directory: the
+ * candidates are one binary-searched range. */
+void complete_file(const char *word, size_t n, bool list, Completion *c) {
+    char dir[PATH_MAX];
+    const char *slash = (const char *)memrchr(word, '/', n);
+    size_t dir_len = slash ? (size_t)(slash - word) + 1 : 0;
+    const char *base = word + dir_len;
+    size_t base_len = n - dir_len;
+    if (dir_len >= PATH_MAX) return;
+    memcpy(dir, word, dir_len);
+    dir[dir_len] = '\0';
+
+    DirIndex *idx = get_dir_index(dir_len ? dir : ".");
+    if (!idx) return;
+    size_t lo, hi;
+    prefix_range(idx, base, base_len, &lo, &hi);
+
+    /* Hidden files are only offered once a dot is typed. They sort together,
+     * so leaving them out cuts one block out of the range. */
+    size_t hid_lo = hi, hid_hi = hi;
+    if (!base_len) prefix_range(idx, ".", 1, &hid_lo, &hid_hi);
+    c->count = (hi - lo) - (hid_hi - hid_lo);
+    if (!c->count) return;
+
+    /* The common prefix of a sorted range is that of its ends. */
+    const char *first = idx->names[hid_lo == lo ? hid_hi : lo];
+    const char *last = idx->names[(hid_hi == hi ? hid_lo : hi) - 1];
+    size_t common = 0;
+    while (first[common] && first[common] == last[common]) common++;
+
+    char *text = (char *)arena_alloc(&cmd_arena, dir_len + common + 1);
+    memcpy(text, word, dir_len);
+    memcpy(text + dir_len, first, common);
+    c->common = text;
+    c->common_len = dir_len + common;
+
+    if (c->count == 1) {
+        unsigned char type = dir_entry_type(first);
+        if (dir_len + common + 1 < PATH_MAX) strcpy(dir + dir_len, first);
+        c->is_dir = type == DT_DIR ||
+                    ((type == DT_LNK || type == DT_UNKNOWN) && is_directory(dir));
+    }
+    for (size_t i = lo; list && i < hi; i++) {
+        if (i == hid_lo) i = hid_hi;
+        if (i == hi) break;
+        if (c->names.len == COMPLETION_LIST_MAX) {
+            c->more = true;
+            break;
+        }
+        argvec_push(&c->names, idx->names[i]);
+    }
+}
+
+/* Prints completion candidates in columns below the line. */
+void list_candidates(const Completion *c) {
+    struct winsize ws;
+    size_t cols = 80, width = 0;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col) cols = ws.ws_col;
+    for (size_t i = 0; i < c->names.len; i++) {
+        size_t len = strlen(c->names.items[i]);
+        if (len > width) width = len;
+    }
+    width += 2;
+    size_t per_row = (cols / width) ? cols / width : 1;
+
+    printf("\r\n");
+    for (size_t i = 0; i < c->names.len; i++) {
+        bool end_row = (i + 1) % per_row == 0 || i + 1 == c->names.len;
+        printf("%-*s%s", end_row ? 0 : (int)width, c->names.items[i],
+               end_row ? "\r\n" : "");
+    }
+    if (c->more) printf("...\r\n");
+    fflush(stdout);
+}
+
+bool is_completion_break(char c) {
+    return c == ' ' || c == '\t' || strchr("|;&<>()", c);
+}
+
+/* Completes the word before the cursor: a command name in command
+ * position, otherwise a file name. If the word can't be extended, lists the
+ * candidates when list is set (a second Tab) and rings the bell otherwise. */
+void complete(LineEditor *ed, bool list) {
+    size_t start = ed->pos;
+    while (start && (!is_completion_break(ed->buf[start - 1]) ||
+                     (start >= 2 && ed->buf[start - 2] == '\\')))
+        start--;
+
+    /* Complete the word as the lexer will see it, without escapes or
+     * quotes. */
+    char word[CMDLINE_MAX];
+    size_t n = 0;
+    for (size_t i = start; i < ed->pos; i++) {
+        char ch = ed->buf[i];
+        if (ch == '\\' && i + 1 < ed->pos)
+            ch = ed->buf[++i];
+        else if (ch == '\'' || ch == '"')
+            continue;
+        word[n++] = ch;
+    }
+
+    size_t before = start;
+    while (before && (ed->buf[before - 1] == ' ' || ed->buf[before - 1] == '\t'))
+        before--;
+    bool command = !before || strchr("|;&(", ed->buf[before - 1]);
+
+    Completion c;
+    memset(&c, 0, sizeof(c));
+    if (command && !memchr(word, '/', n))
+        complete_command(word, n, list, &c);
+    else
+        complete_file(word, n, list, &c);
+
+    if (!c.count) {
+        write(STDOUT_FILENO, "\a", 1);
+        return;
+    }
+    if (c.common_len > n) insert_escaped(ed, c.common + n, c.common_len - n);
+    if (c.count == 1) {
+        insert_char(ed, c.is_dir ? '/' : ' ');
+    } else if (c.common_len == n) {
+        if (list)
+            list_candidates(&c);
+        else
+            write(STDOUT_FILENO, "\a", 1);
+    }
+}
+
+/* Prints the prompt and reads one line without editing, echoing it if the
+ * terminal didn't. Returns false on EOF. */
+bool read_plain_line(char *input, bool echo) {
+    char *nl;
+
+    /* Print prompt */
+    printf(PROMPT);
+    fflush(stdout);
+
+    /* Get command line */
+    if (!fgets(input, CMDLINE_MAX, stdin)) return false;
+
+    /* Print command line if stdin is not provided by terminal */
+    if (echo) {
+        printf("%s", input);
+        fflush(stdout);
+    }
+
+    /* Remove trailing newline from command line */
+    nl = strchr(input, '\n');
+    if (nl) *nl = '\0';
+    return true;
+}
+
+/* Reads one line from the terminal with editing, history recall (up/down),
+ * incremental search (Ctrl-R) and completion (Tab). Returns false on EOF. */
+bool edit_line(char *input) {
+    struct termios orig;
+    if (!enable_raw_mode(&orig)) {
+        /* A terminal that can't go raw still gets a prompt and history. */
+        if (!read_plain_line(input, false)) return false;
+        history_add(input);
+        return true;
+    }
+
+    LineEditor ed;
+    memset(&ed, 0, sizeof(ed));
+    ed.buf = input;
+    ed.buf[0] = '\0';
+    history_load();
+    ed.hist_pos = history_count();
+
+    bool ok = true;
+    bool last_tab = false;
+    refresh_line(&ed);
+    while (1) {
+        char c;
+        if (read(STDIN_FILENO, &c, 1) != 1) {
+            ok = false;
+            break;
+        }
+        int key = (unsigned char)c;
+        if (key == KEY_ESC) key = read_escape();
+
+        if (ed.searching) {
+            if (key == CTRL_KEY('r')) {
+                search_step(&ed, ed.hist_pos);
+            } else if (key == KEY_BACKSPACE || key == CTRL_KEY('h')) {
+                if (ed.query_len) ed.query[--ed.query_len] = '\0';
+                search_step(&ed, history_count());
+            } else if (key >= ' ' && key < KEY_BACKSPACE &&
+                       ed.query_len < sizeof(ed.query) - 1) {
+                ed.query[ed.query_len++] = key;
+                ed.query[ed.query_len] = '\0';
+                /* The current match may still match the longer query. */
+                search_step(&ed, ed.hist_pos + 1);
+            } else if (key == CTRL_KEY('g')) {
+                ed.searching = false;
+                load_history_line(&ed, history_count());
+            } else {
+                /* Any other key accepts the match and is handled below. */
+                ed.searching = false;
+            }
+            if (ed.searching) {
+                refresh_line(&ed);
+                continue;
+            }
+        }
+
+        if (key == '\r' || key == '\n') {
+            break;
+        } else if (key == CTRL_KEY('c')) {
+            ed.len = ed.pos = 0;
+            ed.buf[0] = '\0';
+            write(STDOUT_FILENO, "^C", 2);
+            break;
+        } else if (key == CTRL_KEY('d')) {
+            if (!ed.len) {
+                ok = false;
+                break;
+            }
+            if (ed.pos < ed.len) {
+                memmove(ed.buf + ed.pos, ed.buf + ed.pos + 1, ed.len - ed.pos);
+                ed.len--;
+            }
+        } else if (key == KEY_DELETE) {
+            if (ed.pos < ed.len) {
+                memmove(ed.buf + ed.pos, ed.buf + ed.pos + 1, ed.len - ed.pos);
+                ed.len--;
+            }
+        } else if (key == KEY_BACKSPACE || key == CTRL_KEY('h')) {
+            if (ed.pos) {
+                memmove(ed.buf + ed.pos - 1, ed.buf + ed.pos,
+                        ed.len - ed.pos + 1);
+                ed.pos--;
+                ed.len--;
+            }
+        } else if (key == KEY_LEFT || key == CTRL_KEY('b')) {
+            if (ed.pos) ed.pos--;
+        } else if (key == KEY_RIGHT || key == CTRL_KEY('f')) {
+            if (ed.pos < ed.len) ed.pos++;
+        } else if (key == KEY_HOME || key == CTRL_KEY('a')) {
+            ed.pos = 0;
+        } else if (key == KEY_END || key == CTRL_KEY('e')) {
+            ed.pos = ed.len;
+        } else if (key == CTRL_KEY('k')) {
+            ed.len = ed.pos;
+            ed.buf[ed.len] = '\0';
+        } else if (key == CTRL_KEY('u')) {
+            memmove(ed.buf, ed.buf + ed.pos, ed.len - ed.pos + 1);
+            ed.len -= ed.pos;
+            ed.pos = 0;
+        } else if (key == CTRL_KEY('w')) {
+            size_t start = ed.pos;
+            while (start && ed.buf[start - 1] == ' ') start--;
+            while (start && ed.buf[start - 1] != ' ') start--;
+            memmove(ed.buf + start, ed.buf + ed.pos, ed.len - ed.pos + 1);
+            ed.len -= ed.pos - start;
+            ed.pos = start;
+        } else if (key == CTRL_KEY('l')) {
+            write(STDOUT_FILENO, "\x1b[H\x1b[2J", 7);
+        } else if (key == KEY_UP || key == CTRL_KEY('p')) {
+            if (ed.hist_pos == history_count()) strcpy(ed.saved, ed.buf);
+            if (ed.hist_pos) load_history_line(&ed, ed.hist_pos - 1);
+        } else if (key == KEY_DOWN || key == CTRL_KEY('n')) {
+            if (ed.hist_pos < history_count())
+                load_history_line(&ed, ed.hist_pos + 1);
+        } else if (key == CTRL_KEY('r')) {
+            if (ed.hist_pos == history_count()) strcpy(ed.saved, ed.buf);
+            ed.searching = true;
+            ed.search_failed = false;
+            ed.query_len = 0;
+            ed.query[0] = '\0';
+        } else if (key == '\t') {
+            complete(&ed, last_tab);
+        } else if (key >= ' ' && key < KEY_BACKSPACE) {
+            insert_char(&ed, key);
+        }
+        last_tab = (key == '\t');
+        refresh_line(&ed);
+    }
+
+    write(STDOUT_FILENO, "\r\n", 2);
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &orig);
+    if (ok) history_add(input);
+    return ok;
+}
+
+/* Prompts for and reads one command line. Returns false on EOF. */
+bool prompt_get_input(char *input) {
+    /* Terminals get the line editor, which prints its own prompt. */
+    if (isatty(STDIN_FILENO)) return edit_line(input);
+    return read_plain_line(input, true);
+}
+
+/* Parses and runs one command line. Returns false on a parse error. */
+bool run_line(char *input) {
+    /* Parse the whole line into a list of pipelines, checking for parsing
+     * errors. */
+    Pipeline *list;
+    ErrorType e = parse_command_list(input, &list);
+    if (e != NO_ERROR) {
+        handle_error(e);
+        return false;
+    }
+
+    read_here_documents(list);
+    run_command_list(list);
+    free_command_list(list);
+    return true;
+}
@@ -0,0 +1,816 @@
+#ifndef SSHELL_H
+#define SSHELL_H
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <time.h>
+#include <ucontext.h>
+
+#define CMDLINE_MAX 512
+#define PT_MAX 512
+#define ARGS_MAX 16
+#define ARENA_CHUNK_SIZE 4096
+#define DIRENT_BUF_SIZE 32768
+#define DIR_CACHE_MAX 64
+#define CAPTURE_INLINE 4096
+#define PROMPT "sshell@ucd$ "
+#define HISTORY_FILE ".sshell_history"
+#define SEARCH_RANGE_MAX 4096
+#define CTRL_KEY(k) ((k) & 0x1f)
+#define COMPLETION_LIST_MAX 200
+#define REPORT_LINE_MAX 4096
+#define REPORT_RECORD_MAX 65536
+#define REPORT_BUF_SIZE 65536
+#define REPORT_FLUSH_MS 100
+#define LOOP_WATCH_MAX 256
+#define KILL_GRACE_MS 1000
+#define COROUTINE_STACK_SIZE (128 * 1024)
+#define BUILTIN_BUF_SIZE 65536
+#define THREAD_POOL_SIZE 4
+#define SPLIT_BLOCK_SIZE (1024 * 1024)
+#define SPLIT_BLOCK_MAX (1024 * 1024 * 1024)
+#define SPLIT_WORKERS_MAX 64
+#define SORT_READ_SIZE (1024 * 1024)
+#define SORT_BUDGET_DEFAULT (256UL * 1024 * 1024)
+#define SORT_THREADS_MAX 16
+#define SORT_PARALLEL_MIN 65536
+#define SORT_RUNS_MAX 64
+#define COUNT_READ_SIZE (1024 * 1024)
+#define COUNT_SLOTS_MIN 1024
+#define FIELD_READ_SIZE (1024 * 1024)
+
+typedef enum cmd_type {
+    BUILTIN_EXIT,
+    BUILTIN_CD,
+    BUILTIN_PWD,
+    NOT_BUILTIN
+} CmdType;
+
+typedef enum error_type {
+    PARSE_ERR_ARG_OVERFLOW,
+    PARSE_ERR_MISSING_CMD,
+    PARSE_ERR_NO_OUTPUT,
+    PARSE_ERR_MISLOCATED_REDIR,
+    PARSE_ERR_UNTERMINATED_QUOTE,
+    PARSE_ERR_NO_HERE_INPUT,
+    PARSE_ERR_MISSING_PAREN,
+    LAUNCH_ERR_ACCESS_DIR,
+    LAUNCH_ERR_ACCESS_FILE,
+    LAUNCH_ERR_CMD_NOT_FOUND,
+    LAUNCH_ERR_HERE_INPUT,
+    LAUNCH_ERR_BAD_OPTION,
+    NO_ERROR
+} ErrorType;
+
+typedef enum redirect_type {
+    NO_REDIRECT,
+    REDIRECT_TRUNCATE,
+    REDIRECT_APPEND
+} RedirectType;
+
+/* Ways of feeding a process's stdin from the command line itself. */
+typedef enum here_type {
+    NO_HERE,
+    HERE_STRING,   // <<<word
+    HERE_DOCUMENT  // <<DELIM, body read from the following input lines
+} HereType;
+
+/* Operators joining pipelines into a command list. */
+typedef enum list_op {
+    LIST_SEQ,  // `;` (also used for the last pipeline of the list)
+    LIST_AND,  // `&&`
+    LIST_OR    // `||`
+} ListOp;
+
+/* Character classes used by the lexer. */
+typedef enum char_class {
+    CC_WORD,
+    CC_SPACE,
+    CC_OPERATOR,  // | & ; > <
+    CC_QUOTE,     // ' "
+    CC_ESCAPE,    // backslash
+    CC_END
+} CharClass;
+
+typedef enum token_type {
+    TOK_WORD,
+    TOK_PIPE,
+    TOK_REDIRECT,         // >
+    TOK_REDIRECT_APPEND,  // >>
+    TOK_HERE_DOCUMENT,    // <<
+    TOK_HERE_STRING,      // <<<
+    TOK_SEMICOLON,
+    TOK_AND,
+    TOK_OR,
+    TOK_END
+} TokenType;
+
+/* Quoting flags recorded for every character of a word. */
+typedef enum quote_flag {
+    QUOTE_NONE = 0,
+    QUOTE_DOUBLE = 1,  // no globbing, variables still expand
+    QUOTE_SINGLE = 2,  // fully literal (single quotes and backslash escapes)
+
+    /* Set during expansion on whitespace coming from an unquoted command
+     * substitution, where the word is split into several arguments. */
+    FIELD_SPLIT = 4,
+
+    /* Set by the lexer on the `(` of every $(cmd) it found, so expansion
+     * never takes an escaped or quoted `$(` for one. */
+    SUBST_OPEN = 8
+} QuoteFlag;
+
+/* Possible parsing states. Used for parse_errors function. */
+typedef enum parse_state {
+    SEEN_PIPE,  // start state
+    SEEN_SEMICOLON,
+    SEEN_REDIRECT,
+    SEEN_HERE,
+    READING_PROCESS,
+    READING_FILENAME
+} ParseState;
+
+typedef enum word_kind {
+    WORD_PLAIN,
+    WORD_PROC_IN,  // <(cmd): text is the inner command line
+    WORD_PROC_OUT  // >(cmd)
+} WordKind;
+
+/* A word of the command line after quote removal. */
+typedef struct word {
+    WordKind kind;
+    char *text;
+
+    /* QuoteFlag of every character of text. */
+    unsigned char *mask;
+
+    /* Set if any part of the word was quoted, so it is kept even if it
+     * expands to nothing (e.g. ""). */
+    bool quoted;
+} Word;
+
+typedef struct token {
+    TokenType type;
+
+    /* Only set for TOK_WORD. */
+    Word word;
+
+    /* Position of the token in the original command line. */
+    int start, end;
+} Token;
+
+typedef struct process {
+    pid_t pid;
+    int exit_val;
+
+    /* Process command (equal to argv[0]). */
+    char *cmd;
+
+    /* Process arguments as typed, terminated by a word with NULL text. */
+    Word args[ARGS_MAX + 1];
+    int num_args;
+
+    /* Arguments after variable and glob expansion, allocated from the command
+     * arena. Filled in right before launch. */
+    char **argv;
+
+    RedirectType redirect_output;
+    Word filename;
+
+    /* Output file after expansion. */
+    char *output_path;
+
+    /* Full path of the command from the command hash, or NULL to let execvp
+     * search PATH. */
+    const char *exec_path;
+
+    /* Here-string word or here-document delimiter. */
+    HereType here_type;
+    Word here_word;
+
+    /* Here-document body, read after the command line. */
+    Word here_body;
+
+    /* Sealed memfd holding the here payload, dup'ed as stdin. -1 if none. */
+    int here_fd;
+
+    /* Process substitutions in the arguments: the fd passed as /dev/fd/N
+     * and the pid of the subshell running the inner command. */
+    int subst_fds[ARGS_MAX + 1];
+    pid_t subst_pids[ARGS_MAX + 1];
+    int num_substs;
+
+    /* File descriptors for input/output streams. */
+    int in, out;
+
+    /* Raw status and resource usage from wait4(), for completion records. */
+    int wait_status;
+    struct rusage rusage;
+
+    /* pidfd the reaper waits on through the event loop, and its watch. */
+    int pidfd;
+    int watch;
+
+    /* Builtin that runs inside the shell instead of forking, and its state
+     * while it runs. */
+    const struct builtin *shell_builtin;
+    struct builtin_io *builtin;
+
+    /* A pipe-split stage's workers are the num_workers stages right before
+     * it. Each worker holds the shell's ends of its stdin and stdout pipes
+     * until the pipe-split builtin takes them over. */
+    struct process *workers;
+    int num_workers;
+    int feed_fd, drain_fd;
+
+    /* For a worker, the pipe-split stage it belongs to; NULL otherwise. */
+    struct process *split;
+
+    struct process *next;
+} Process;
+
+/* One node of a command list: a pipeline plus the operator joining it to the
+ * next pipeline. */
+typedef struct pipeline {
+    Process *head;
+
+    /* Pipeline's part of the command line, printed on completion. Allocated
+     * from the command arena. */
+    char *cmdline;
+
+    ListOp op;
+    int status;
+
+    /* Time from launch until the last process was reaped. */
+    long long wall_ns;
+
+    struct pipeline *next;
+} Pipeline;
+
+/* Keys understood by the line editor. Escape sequences are mapped to codes
+ * above the byte range. */
+typedef enum key {
+    KEY_ESC = 27,
+    KEY_BACKSPACE = 127,
+    KEY_UP = 1000,
+    KEY_DOWN,
+    KEY_RIGHT,
+    KEY_LEFT,
+    KEY_HOME,
+    KEY_END,
+    KEY_DELETE
+} Key;
+
+/* Command history. Entries from previous sessions are read from a memory
+ * mapping of the append-only history file; entries added since are kept in
+ * memory (and appended to the file). */
+typedef struct history {
+    bool loaded;
+    int fd;
+
+    /* History file as it was when loaded. */
+    char *map;
+    size_t map_len;
+
+    /* Start of every entry in map, followed by map_len. */
+    size_t *offsets;
+    size_t num_file;
+
+    char **session;
+    size_t num_session, session_cap;
+
+    /* Suffix array over map, built when it is loaded. NULL if that failed,
+     * and searches then scan the entries. */
+    uint32_t *suffixes;
+} History;
+
+/* State of the line being edited at the prompt. */
+typedef struct line_editor {
+    char *buf;
+    size_t len, pos;
+
+    /* History entry shown, or history_count() for the line being typed,
+     * which is kept in saved while browsing. */
+    size_t hist_pos;
+    char saved[CMDLINE_MAX];
+
+    /* Incremental search (Ctrl-R) state. */
+    bool searching, search_failed;
+    char query[CMDLINE_MAX];
+    size_t query_len;
+} LineEditor;
+
+/* Bump allocator for memory that lives as long as one command line. */
+typedef struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size, used;
+    char data[];
+} ArenaChunk;
+
+typedef struct arena {
+    ArenaChunk *head;
+} Arena;
+
+/* Word being built during expansion, backed by the command arena. */
+typedef struct word_buf {
+    char *text;
+    unsigned char *mask;
+    size_t len, cap;
+} WordBuf;
+
+/* Growable NULL-terminated argument vector backed by the command arena. */
+typedef struct arg_vec {
+    char **items;
+    size_t len, cap;
+} ArgVec;
+
+/* Sorted listing of one directory, cached across commands and rebuilt when
+ * the directory's mtime changes. */
+typedef struct dir_index {
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+
+    /* Set if the directory was modified too recently to trust its mtime. */
+    bool racy;
+
+    size_t count;
+    char **names;
+    char *blob;
+
+    struct dir_index *next;
+} DirIndex;
+
+/* One node of the executable name trie. Children of a node are a sibling
+ * list sorted by character. Nodes refer to each other by index. */
+typedef struct trie_node {
+    char c;
+    int child, sibling;
+
+    /* PATH directory of the name ending at this node, -1 if no name ends
+     * here, or -2 for a builtin. */
+    int dir;
+} TrieNode;
+
+/* Identity of a PATH directory when the cache was filled. */
+typedef struct path_dir {
+    char *name;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    bool racy;
+} PathDir;
+
+/* Command hash entry: a command name and where PATH resolved it to. */
+typedef struct command_entry {
+    char *name;
+    char *path;
+} CommandEntry;
+
+/* Everything cached about the executables on $PATH: the directories, a trie
+ * of their names for completion and a hash of resolved commands. Both are
+ * dropped together when $PATH or one of its directories changes. */
+typedef struct path_cache {
+    char *path_env;
+    PathDir *dirs;
+    size_t num_dirs;
+    bool snapshot;
+
+    TrieNode *nodes;
+    size_t num_nodes, nodes_cap;
+
+    CommandEntry *hash;
+    size_t hash_cap, hash_used;
+} PathCache;
+
+/* Where completion records go. In batch mode records are collected in buf
+ * and written out once it fills up, once the oldest is REPORT_FLUSH_MS old,
+ * or when the shell runs out of input. */
+typedef struct reporter {
+    int fd;
+    bool batch;
+
+    /* Write NDJSON records instead of text. seq numbers them. */
+    bool json;
+    unsigned long long seq;
+
+    char buf[REPORT_BUF_SIZE];
+    size_t len;
+
+    /* When the oldest record in buf was added. */
+    struct timespec oldest;
+} Reporter;
+
+/* Output buffer for serializing one JSON record without allocating. Writes
+ * past cap are dropped and set overflow. */
+typedef struct json_buf {
+    char *buf;
+    size_t len, cap;
+    bool overflow;
+} JsonBuf;
+
+/* Candidates for the word being completed. */
+typedef struct completion {
+    /* Text every candidate starts with, including what was typed. */
+    const char *common;
+    size_t common_len;
+
+    /* Number of candidates; for commands only 0, 1 or 2 (several). */
+    size_t count;
+
+    /* Set if the only candidate is a directory. */
+    bool is_dir;
+
+    /* Candidates to list, if asked for. more is set if there are others. */
+    ArgVec names;
+    bool more;
+} Completion;
+
+/* Counters over every stage the shell has reaped, shown by `stats`. */
+typedef struct stats {
+    unsigned long pipelines;
+    unsigned long stages;
+
+    /* Stages that exited with a nonzero value. */
+    unsigned long failed;
+
+    /* Stages killed by a signal, by signal number, and those that dumped
+     * core. */
+    unsigned long signaled;
+    unsigned long by_signal[NSIG];
+    unsigned long core_dumps;
+
+    /* Pipelines whose remaining stages failfast terminated, and pipelines
+     * stopped for running past the timeout. */
+    unsigned long cancelled;
+    unsigned long timed_out;
+} Stats;
+
+/* Options changed with `set -o NAME` and `set +o NAME`. */
+typedef struct shell_options {
+    /* A pipeline's status is that of its last failing stage, not its last
+     * stage. */
+    bool pipefail;
+
+    /* Run each pipeline in its own process group and terminate the group
+     * once a stage fails. */
+    bool failfast;
+
+    /* Run builtins on the thread pool rather than as coroutines. */
+    bool threads;
+
+    /* Seconds a pipeline may run before it is sent SIGTERM, then SIGKILL
+     * every KILL_GRACE_MS. 0 for none. */
+    unsigned timeout;
+
+    /* Hand builtin output to pipes with vmsplice() rather than write(). */
+    bool splice;
+} ShellOptions;
+
+/* A stackful coroutine on its own mmap'd stack. */
+typedef struct coroutine {
+    ucontext_t ctx;
+
+    /* Where co_yield() and returning from the entry point go back to. */
+    ucontext_t caller;
+
+    char *stack;
+    bool done;
+} Coroutine;
+
+/* Position of builtin_getopt() in an argv, and the argument of the option it
+ * returned last. */
+typedef struct opt_state {
+    int ind, pos;
+    char *arg;
+} OptState;
+
+/* A builtin run inside the shell as a coroutine. Its I/O calls yield back to
+ * the reaper whenever they would block, so several builtins and the forked
+ * stages of a pipeline run together on one thread. With `set -o threads` it
+ * runs on a worker thread instead and blocks there. */
+typedef struct builtin_io {
+    Coroutine co;
+    const struct builtin *builtin;
+    char **argv;
+    OptState opt;
+
+    /* The stage it runs as. */
+    struct process *stage;
+
+    /* Running on a worker: the shell writes wake_fd to stop it and the
+     * worker writes done_fd when it has returned. */
+    bool threaded;
+    int wake_fd, done_fd;
+
+    /* The shell's own copies of the stage's stdin and stdout. Pipe ends the
+     * shell created are made non-blocking and tried right away; other fds
+     * (the shell's own stdin and stdout) are waited on before each call. */
+    int in, out;
+    bool in_nonblock, out_nonblock;
+
+    /* What the coroutine waits for while it is yielded, and its watch. */
+    int wait_fd;
+    short wait_events;
+    int watch;
+
+    /* Signal the builtin was stopped with, after which every I/O call fails,
+     * or set if a write found the reader gone. */
+    int cancel;
+    bool broken_pipe;
+
+    int status;
+
+    /* Buffered stdout, BUILTIN_BUF_SIZE bytes of whole pages. When stdout
+     * is a pipe and out_splice is set, a flush moves the pages into it, and
+     * buf takes turns with spare, the buffer spliced by the flush before. */
+    char *buf, *spare;
+    size_t len;
+    bool out_splice;
+} BuiltinIO;
+
+typedef int (*BuiltinFn)(BuiltinIO *io, int argc, char **argv);
+
+/* A builtin that runs inside the shell. opts is its getopt() option string;
+ * with an option it doesn't know the command runs from PATH instead. NULL
+ * opts means arguments are ignored. */
+typedef struct builtin {
+    const char *name;
+    const char *opts;
+    BuiltinFn run;
+} Builtin;
+
+/* Options of a pipe-split or pmap stage and the command its workers run.
+ * path is pmap's file. */
+typedef struct split_options {
+    int jobs;
+    size_t block;
+    bool keep_order, round_robin;
+    char *path;
+    char **cmd;
+} SplitOptions;
+
+/* What a pipe-split epoll event is for. Its data is the worker's index times
+ * four plus this. */
+typedef enum { SPLIT_INPUT, SPLIT_FEED, SPLIT_DRAIN, SPLIT_PIDFD } SplitEvent;
+
+/* A worker pipe-split feeds, or with -k the job running one block. */
+typedef struct split_worker {
+    /* The shell's ends of its stdin and stdout, -1 once closed. */
+    int feed, drain;
+    uint32_t feed_events;
+
+    /* Block being written to feed, NULL once it can take another. */
+    char *block;
+    size_t len, sent;
+
+    /* Output read from drain and not yet passed on. */
+    char *out;
+    size_t out_len, out_cap;
+
+    /* With -k: whether the slot holds a job, the job's pid (0 once reaped)
+     * and pidfd, and the number of its block. */
+    bool active;
+    pid_t pid;
+    int pidfd;
+    size_t seq;
+} SplitWorker;
+
+/* State of a running pipe-split builtin. */
+typedef struct splitter {
+    SplitOptions opt;
+    int epoll;
+
+    SplitWorker workers[SPLIT_WORKERS_MAX];
+    int num_workers;
+
+    /* Input read but not yet handed out, and the length of the block at its
+     * start that is ready to go (0 until one is). */
+    char *pending;
+    size_t pending_len, pending_cap, cut;
+    bool eof;
+    uint32_t in_events;
+
+    /* Input that epoll can't wait on (a regular file) is always ready. */
+    bool in_always;
+
+    /* pmap's file, mapped. Blocks are handed out from the mapping rather
+     * than copied, with pending pointing into it. */
+    char *map;
+    size_t map_len;
+
+    /* Next worker with -r. With -k, the number of the next block and of the
+     * block whose output is passed on next, and the stage its jobs run as. */
+    int next;
+    size_t next_seq, emit_seq;
+    struct process *job;
+
+    int status;
+} Splitter;
+
+/* A line being sorted, without its newline. prefix holds its first eight
+ * bytes big-endian, zero-padded, so most comparisons need no memcmp(). */
+typedef struct sort_line {
+    uint64_t prefix;
+    const char *text;
+    size_t len;
+} SortLine;
+
+/* A sorted run spilled to a temporary file, and its current line while it
+ * is merged. */
+typedef struct sort_run {
+    FILE *file;
+    char *buf;
+    size_t cap;
+    SortLine cur;
+} SortRun;
+
+/* State of a running sort builtin. */
+typedef struct sorter {
+    bool reverse, unique;
+    size_t budget;
+    int threads;
+
+    /* Lines read since the last spill. Their text is allocated from the
+     * arena, and arena_used counts its bytes. The array is kept across
+     * spills and grows with realloc(). */
+    Arena arena;
+    size_t arena_used;
+    SortLine *lines;
+    size_t num_lines, cap_lines;
+
+    SortRun runs[SORT_RUNS_MAX];
+    int num_runs;
+
+    /* With -u, the last line written. */
+    char *last;
+    size_t last_len, last_cap;
+    bool have_last;
+} Sorter;
+
+/* Part of a parallel sort: sorting lines [lo, hi) of src in place, or
+ * merging its sorted halves [lo, mid) and [mid, hi) into dst. */
+typedef struct sort_task {
+    SortLine *src, *dst;
+    size_t lo, mid, hi;
+    bool *reverse;
+} SortTask;
+
+/* A key counted by the count builtin. Its text lives in the arena. */
+typedef struct count_entry {
+    const char *key;
+    size_t len;
+    unsigned long count;
+} CountEntry;
+
+/* Slot of the count builtin's open-addressing table: an entry's index plus
+ * one, or 0 while empty, next to its key's hash so that probing reads an
+ * entry only when the hashes match. */
+typedef struct count_slot {
+    uint32_t hash, index;
+} CountSlot;
+
+/* State of a running count builtin. */
+typedef struct counter {
+    /* Field to count, or 0 for whole lines, and the delimiter between
+     * fields, or 0 for runs of blanks. */
+    int field;
+    char delim;
+
+    char *buf;
+    size_t buf_cap;
+
+    Arena arena;
+    CountEntry *entries;
+    size_t num_entries, cap_entries;
+    CountSlot *slots;
+    size_t mask;
+} Counter;
+
+/* Fields lo to hi of a field list, counting from 1. */
+typedef struct field_range {
+    int lo, hi;
+} FieldRange;
+
+/* The last 16 bytes the field scanner compared, and which of them it has
+ * yet to stop at. */
+typedef struct field_scan {
+    const char *block;
+    unsigned mask;
+} FieldScan;
+
+/* State of a running field builtin. */
+typedef struct fielder {
+    FieldRange *ranges;
+    int num_ranges;
+    /* Highest field selected, INT_MAX for an open range. */
+    int last;
+
+    /* Field delimiter, or 0 to split at runs of blanks. stops marks the
+     * bytes the scanner stops at: the delimiters and newline. */
+    char delim;
+    bool stops[256];
+
+    char *buf;
+    size_t buf_cap;
+} Fielder;
+
+/* A thread of the pool and the builtin it runs, NULL while idle. */
+typedef struct worker {
+    pthread_t thread;
+    bool started;
+    pthread_cond_t work;
+    BuiltinIO *job;
+} Worker;
+
+/* Worker threads for builtins, started as needed. lock guards the jobs. */
+typedef struct thread_pool {
+    pthread_mutex_t lock;
+    Worker workers[THREAD_POOL_SIZE];
+} ThreadPool;
+
+/* Rings shared with the kernel by io_uring_setup(). */
+typedef struct uring {
+    int fd;
+    unsigned entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+
+    /* Mappings to undo; cq_ring is NULL when it shares sq_ring's. */
+    void *sq_ring, *cq_ring;
+    size_t sq_size, cq_size, sqes_size;
+} Uring;
+
+/* A file descriptor the event loop waits on until it is ready for events. */
+typedef struct watch {
+    int fd;
+    short events;
+    void *data;
+    bool active;
+
+    /* io_uring: a poll request for it is in flight. gen tells completions
+     * of an earlier use of the slot apart. */
+    bool armed;
+    unsigned gen;
+} Watch;
+
+/* The shell's event loop. Readiness of every watched descriptor (pidfds,
+ * timerfds, pipes) is waited for in one call, through io_uring one-shot polls
+ * that are re-armed as they fire, or through poll() where io_uring isn't
+ * available or SSHELL_EVENTS=poll. */
+typedef struct event_loop {
+    bool started;
+    bool uring;
+    Uring ring;
+    Watch watches[LOOP_WATCH_MAX];
+} EventLoop;
+
+/* Shell state shared by the core and main(). */
+extern Arena cmd_arena;
+extern int last_status;
+extern bool in_subshell;
+extern bool single_line;
+extern Reporter reporter;
+
+void handle_error(ErrorType e);
+
+/* Parsing: lex a line into tokens, check them, and build the command list
+ * (one Process list per pipeline). */
+ErrorType lex_line(char *line, unsigned char *mask, Token tokens[]);
+int parse_errors(Token tokens[]);
+Process *initialize_processes(Token **tok);
+ErrorType parse_command_list(char *input, Pipeline **list);
+void free_processes(Process *head);
+void free_command_list(Pipeline *head);
+
+/* Execution. */
+void create_pipes(Process *head);
+void close_pipes(Process *head);
+void read_here_documents(Pipeline *list);
+void run_processes(Pipeline *pl);
+void run_command_list(Pipeline *head);
+bool run_line(char *input);
+
+/* Command arena. */
+void *arena_alloc(Arena *a, size_t n);
+char *arena_strndup(Arena *a, const char *s, size_t n);
+void arena_reset(Arena *a);
+void arena_free(Arena *a);
+
+/* Completion records. */
+bool report_open(const char *path);
+void report_flush();
+void report_idle();
+
+/* Input. */
+bool prompt_get_input(char *input);
+
+#endif
@@ -0,0 +1,44 @@
+#!/bin/sh
+# Pipes each tests/NAME.in to the shell, one command per line, in a fresh
+# directory, and compares its stdout and stderr with NAME.out and NAME.err.
+# Cases can start another shell as $SSHELL. `tests/run.sh -u SHELL` rewrites
+# the expected files instead.
+
+update=false
+if [ "$1" = "-u" ]; then
+    update=true
+    shift
+fi
+shell=$(cd "$(dirname "${1:-./sshell}")" && pwd)/$(basename "${1:-./sshell}")
+dir=$(cd "$(dirname "$0")" && pwd)
+
+# Keep results independent of the caller's locale and history.
+export LC_ALL=C
+export SSHELL_HISTFILE=/dev/null
+export SSHELL="$shell"
+
+failed=0
+for input in "$dir"/*.in; do
+    [ -e "$input" ] || continue
+    name=$(basename "$input" .in)
+    work=$(mktemp -d)
+    (cd "$work" && cat "$input" | "$shell" > out 2> err)
+    if $update; then
+        cp "$work/out" "$dir/$name.out"
+        cp "$work/err" "$dir/$name.err"
+    elif cmp -s "$work/out" "$dir/$name.out" &&
+         cmp -s "$work/err" "$dir/$name.err"; then
+        echo "ok   $name"
+    else
+        echo "FAIL $name"
+        diff -u "$dir/$name.out" "$work/out"
+        diff -u "$dir/$name.err" "$work/err"
+        failed=$((failed + 1))
+    fi
+    rm -rf "$work"
+done
+
+if [ "$failed" -ne 0 ]; then
+    echo "$failed test(s) failed"
+    exit 1
+fi